@@ -8,27 +8,402 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+#include <memory>
+#include <tuple>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdio>
+#include <stdio_ext.h>
+#include <string_view>
+#include <span>
+#include <queue>
+#include <new>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <thread>
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//vector kernels are compiled for their instruction set and picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define T9_X86_KERNELS
+#endif
 
 using namespace std;
 
+//approximate heap usage of standard containers, for memory accounting
+size_t heap_bytes(const string& s) {
+	const char* p = s.data();
+	bool local = p >= reinterpret_cast<const char*>(&s) && p < reinterpret_cast<const char*>(&s + 1);
+	return local ? 0 : s.capacity() + 1;
+}
+
+template<typename container>
+size_t table_bytes(const container& c) {
+	//every node holds a value, the next pointer and a cached hash
+	return c.bucket_count() * sizeof(void*)
+			+ c.size() * (sizeof(typename container::value_type) + 2 * sizeof(void*));
+}
+
+/**
+ * Counts occurrences of strings.
+ * Open addressing with linear probing; the strings are copied into a single arena
+ * and are visited in the order they were first added.
+ */
+class hash_counter {
+public:
+	/**
+	 * Counts one more occurrence of the string and returns its count.
+	 */
+	size_t add(const char* s, size_t length) {
+		if (2 * (entries.size() + 1) > slots.size()) {
+			grow();
+		}
+
+		size_t h = hash(s, length);
+		size_t mask = slots.size() - 1;
+		for (size_t i = h & mask;; i = (i + 1) & mask) {
+			slot& sl = slots[i];
+			if (sl.index == empty) {
+				sl = {h, entries.size()};
+				entries.push_back( { keys.size(), length, 1 });
+				keys.insert(keys.end(), s, s + length);
+				return 1;
+			}
+			if (sl.hash == h) {
+				entry& e = entries[sl.index];
+				if (e.length == length && memcmp(keys.data() + e.offset, s, length) == 0) {
+					return ++e.count;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Calls `f(data, length, count)` for every distinct string.
+	 */
+	template<typename function>
+	void for_each(function f) const {
+		for (const entry& e : entries) {
+			f(keys.data() + e.offset, e.length, e.count);
+		}
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+private:
+	static const size_t empty = -1;
+
+	struct slot {
+		size_t hash;
+		size_t index; //into entries
+	};
+
+	struct entry {
+		size_t offset; //into keys
+		size_t length;
+		size_t count;
+	};
+
+	vector<slot> slots;
+	vector<entry> entries;
+	vector<char> keys;
+
+	//FNV-1a
+	static size_t hash(const char* s, size_t length) {
+		uint64_t h = 14695981039346656037ull;
+		for (size_t i = 0; i < length; ++i) {
+			h ^= static_cast<unsigned char>(s[i]);
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	void grow() {
+		vector<slot> old(max<size_t>(16, 2 * slots.size()), slot { 0, empty });
+		old.swap(slots);
+		size_t mask = slots.size() - 1;
+		for (const slot& sl : old) {
+			if (sl.index == empty) {
+				continue;
+			}
+			size_t i = sl.hash & mask;
+			while (slots[i].index != empty) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = sl;
+		}
+	}
+};
+
+/**
+ * Hashes strings and string views alike, so that maps keyed by strings can be searched
+ * without constructing a string.
+ */
+struct key_hash {
+	using is_transparent = void;
+
+	size_t operator()(string_view s) const {
+		return hash<string_view>()(s);
+	}
+};
+
+template<typename value>
+using key_map = unordered_map<string, value, key_hash, equal_to<>>;
+
+/**
+ * Allocates memory backed by huge pages of the given size, 2 MB or 1 GB.
+ * If no such pages are reserved, asks for transparent huge pages instead.
+ * With a page size of 0 it allocates ordinary memory.
+ */
+template<typename T>
+class huge_page_allocator {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = true_type;
+	using propagate_on_container_move_assignment = true_type;
+	using propagate_on_container_swap = true_type;
+
+	size_t page_size;
+
+	explicit huge_page_allocator(size_t page_size = 0) noexcept :
+			page_size(page_size) {
+	}
+
+	template<typename U>
+	huge_page_allocator(const huge_page_allocator<U>& other) noexcept :
+			page_size(other.page_size) {
+	}
+
+	T* allocate(size_t n) {
+		if (!page_size) {
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+
+		size_t length = mapped_length(n);
+		void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		int size_flag = (page_size >= (1 << 30) ? 30 : 21) << MAP_HUGE_SHIFT;
+		p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+#endif
+		if (p == MAP_FAILED) {
+			p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				throw bad_alloc();
+			}
+#ifdef MADV_HUGEPAGE
+			madvise(p, length, MADV_HUGEPAGE);
+#endif
+		}
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t n) noexcept {
+		if (!page_size) {
+			::operator delete(p);
+		} else {
+			munmap(p, mapped_length(n));
+		}
+	}
+
+	friend bool operator==(const huge_page_allocator& a, const huge_page_allocator& b) {
+		return a.page_size == b.page_size;
+	}
+
+private:
+	size_t mapped_length(size_t n) const {
+		return (n * sizeof(T) + page_size - 1) / page_size * page_size;
+	}
+};
+
+/**
+ * Interned words shared by several dictionaries.
+ * Every word is stored once, together with the number of dictionaries that use it.
+ */
+class word_pool {
+public:
+	using entry = pair<const string, size_t>;
+
+	/**
+	 * Returns the stored copy of the word and counts a new user of it.
+	 */
+	const entry* acquire(const string& word) {
+		auto it = words.emplace(word, 0).first;
+		++it->second;
+		return &*it;
+	}
+
+	/**
+	 * Returns the stored copy of the word or nullptr if no dictionary uses it.
+	 */
+	const entry* find(string_view word) const {
+		auto it = words.find(word);
+		return it != words.end() ? &*it : nullptr;
+	}
+
+	/**
+	 * Drops a user of the word, removing it when no dictionary uses it anymore.
+	 */
+	void release(const entry* word) {
+		auto it = words.find(word->first);
+		if (--it->second == 0) {
+			words.erase(it);
+		}
+	}
+
+	size_t memory_usage() const {
+		size_t total = table_bytes(words);
+		for (const entry& e : words) {
+			total += heap_bytes(e.first);
+		}
+		return total;
+	}
+
+private:
+	key_map<size_t> words;
+};
+
 class T9_dictionary {
+public:
+	//the candidates of a digit sequence in the compressed storage mode, described below
+	struct packed_list {
+		size_t offset; //in bytes, into the arena
+		size_t index; //of the first candidate, into frequencies
+		size_t size;
+	};
+
+	/**
+	 * A compressed dictionary compiled into the program, as written by `write_embedded`.
+	 * Digit sequences are sorted and found by binary search, so nothing is built at run time.
+	 */
+	struct embedded_index {
+		const char* keys; //digit sequences back to back
+		const uint32_t* key_offsets; //of every digit sequence into keys, and of the end of the last one
+		const packed_list* lists; //of every digit sequence
+		size_t size; //number of digit sequences
+		const unsigned char* arena;
+		const size_t* frequencies; //nullptr if every word occurred once
+	};
+
 private:
 
-	char digit[128]; //a lookup table for converting letters into digits
+	char digit[128] = { }; //a lookup table for converting letters into digits
+
+	//used by the compressed storage mode and the multi-tap decoder
+	char letter[128][4] = { }; //letter[d][i] is the i-th letter on the key with digit d
+	unsigned char letter_count[128] = { }; //number of letters on the key with digit d
+	unsigned char choice[128] = { }; //position of a letter on its key
+
+	shared_ptr<word_pool> pool; //nullptr if the dictionary owns its words
+	//candidates of a key with their number of occurrences, the words kept either in the map
+	//or in the pool
+	using candidate_map = unordered_map<string, size_t>;
+	using pooled_candidate_map = unordered_map<const word_pool::entry*, size_t>;
 
-	static const unordered_set<string> not_found; //returned when no match is found
+	key_map<candidate_map> data; //used without a pool
+	key_map<pooled_candidate_map> pooled_data; //used with a pool
 
-	unordered_map<string, unordered_set<string>> data;
+	/*
+	 * Compressed storage mode.
+	 * All candidates for a key have the same length and every letter is one of at most 4 letters
+	 * on its key, so a word is stored as a sequence of 2 bit letter choices, first letter in the
+	 * most significant bits. Candidates of a key are kept back to back in the arena, the most frequent
+	 * first and alphabetically among equally frequent ones.
+	 * An embedded dictionary keeps the same arena and lists in its embedded_index.
+	 */
+	bool compressed = false;
+	const embedded_index* embedded = nullptr;
+	key_map<packed_list> packed_data;
+	vector<unsigned char, huge_page_allocator<unsigned char>> arena;
+	vector<size_t, huge_page_allocator<size_t>> frequencies; //empty if every word occurred once
+	size_t packed_words = 0;
+	size_t reserved_words = 0; //frequencies are reserved for this many once they are needed
+	size_t garbage = 0; //bytes of the arena no longer used after updates
 
-	//helper function for filling the lookup table
+	//helper function for filling the lookup tables
 	void map(initializer_list<char> what, char to) {
+		unsigned char i = 0;
 		for (char c : what) {
 			digit[static_cast<size_t>(c)] = to;
+			letter[static_cast<size_t>(to)][i] = c;
+			choice[static_cast<size_t>(c)] = i;
+			++i;
+		}
+		letter_count[static_cast<size_t>(to)] = i;
+	}
+
+	void pack(string_view word, unsigned char* out) const {
+		memset(out, 0, packed_width(word.size()));
+		for (size_t i = 0; i < word.size(); ++i) {
+			out[i / 4] |= choice[static_cast<size_t>(word[i])] << (6 - 2 * (i % 4));
+		}
+	}
+
+#ifdef T9_X86_KERNELS
+	//encodes whole blocks of 16 characters, advancing `first` past them; the rest is left to `encode`
+	__attribute__((target("ssse3")))
+	bool encode_ssse3(char*& first, char* last) const {
+		//a letter is looked up by its low nibble in the table for its high nibble (6 or 7)
+		alignas(16) char low[2][16];
+		for (int i = 0; i < 16; ++i) {
+			low[0][i] = digit[0x60 + i];
+			low[1][i] = digit[0x70 + i];
+		}
+		const __m128i table6 = _mm_load_si128(reinterpret_cast<const __m128i*>(low[0]));
+		const __m128i table7 = _mm_load_si128(reinterpret_cast<const __m128i*>(low[1]));
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		const __m128i six = _mm_set1_epi8(6);
+		const __m128i seven = _mm_set1_epi8(7);
+		const __m128i newline = _mm_set1_epi8('\n');
+		const __m128i zero = _mm_setzero_si128();
+		__m128i invalid = zero;
+
+		for (; last - first >= 16; first += 16) {
+			__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+			__m128i lo = _mm_and_si128(in, nibble);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), nibble);
+			__m128i out = _mm_or_si128(
+					_mm_and_si128(_mm_cmpeq_epi8(hi, six), _mm_shuffle_epi8(table6, lo)),
+					_mm_and_si128(_mm_cmpeq_epi8(hi, seven), _mm_shuffle_epi8(table7, lo)));
+			out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(in, newline), newline));
+			invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(out, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(first), out);
+		}
+		return _mm_movemask_epi8(invalid) == 0;
+	}
+#endif
+
+	void unpack(string_view key, const unsigned char* in, string& out) const {
+		for (size_t i = 0; i < key.size(); ++i) {
+			unsigned char c = (in[i / 4] >> (6 - 2 * (i % 4))) & 3;
+			out[i] = letter[static_cast<size_t>(key[i])][c];
 		}
 	}
 
 public:
-	T9_dictionary() {
+	/**
+	 * Creates an empty dictionary. Dictionaries created with the same pool share their words,
+	 * one created without a pool keeps its own copies of them.
+	 */
+	explicit T9_dictionary(shared_ptr<word_pool> pool = nullptr) :
+			pool(move(pool)) {
 		map( { 'a', 'b', 'c' }, '2');
 		map( { 'd', 'e', 'f' }, '3');
 		map( { 'g', 'h', 'i' }, '4');
@@ -39,60 +414,1889 @@ public:
 		map( { 'w', 'x', 'y', 'z' }, '9');
 	}
 
-	void add_word(const string& word) {
+	/**
+	 * Creates a compressed dictionary that reads its words from the embedded index,
+	 * which has to outlive it. It cannot be modified.
+	 */
+	explicit T9_dictionary(const embedded_index& index) :
+			T9_dictionary() {
+		embedded = &index;
+		compressed = true;
+	}
+
+	//words are reference counted in the pool
+	T9_dictionary(const T9_dictionary&) = delete;
+	T9_dictionary& operator=(const T9_dictionary&) = delete;
+
+	~T9_dictionary() {
+		release_words();
+	}
+
+	/**
+	 * Converts lowercase letters in `[first, last)` into digits in place, leaving newlines as they are.
+	 * @return false if there are other characters in the range
+	 */
+	bool encode(char* first, char* last) const {
+		bool valid = true;
+
+#ifdef T9_X86_KERNELS
+		static const bool ssse3 = __builtin_cpu_supports("ssse3");
+		if (ssse3) {
+			valid = encode_ssse3(first, last);
+		}
+#endif
+
+		for (; first != last; ++first) {
+			unsigned char c = *first;
+			if (c == '\n') {
+				continue;
+			}
+			*first = c < 128 ? digit[c] : 0;
+			valid &= *first != 0;
+		}
+		return valid;
+	}
+
+	/**
+	 * Decodes a multi-tap sequence, where a letter is typed by pressing its key once for every
+	 * position of the letter on the key and letters on the same key are separated by a space,
+	 * e.g. "44 444" is "hi". Pressing a key more times than it has letters wraps around.
+	 * The state is the key being pressed and the number of presses; a letter is emitted
+	 * on a transition to another key or a space.
+	 * @return false if there are other characters than digits 2-9 and spaces, or no letters at all
+	 */
+	bool decode_multitap(string_view in, string& out) const {
+		out.clear();
+		size_t key = 0; //0 between letters
+		size_t presses = 0;
+		for (char c : in) {
+			size_t next = c == ' ' ? 0 : static_cast<unsigned char>(c);
+			if (next >= 128 || (next && !letter_count[next])) {
+				return false;
+			}
+			if (key && next != key) {
+				out.push_back(letter[key][(presses - 1) % letter_count[key]]);
+				presses = 0;
+			}
+			key = next;
+			presses += key != 0;
+		}
+		if (key) {
+			out.push_back(letter[key][(presses - 1) % letter_count[key]]);
+		}
+		return !out.empty();
+	}
+
+	/**
+	 * Checks whether the word made of lowercase letters is in the dictionary.
+	 */
+	bool contains(string_view word) const {
+		thread_local string key;
+		key.assign(word);
+		if (!encode(key.data(), key.data() + key.size())) {
+			return false;
+		}
+
+		bool found = false;
+		get(key, [&found, word](string_view candidate, size_t) {
+			found |= candidate == word;
+		});
+		return found;
+	}
+
+	/**
+	 * Adds `count` occurrences of a word made of lowercase letters.
+	 * In the compressed storage mode this rewrites the list of the word's digit sequence.
+	 * @throws logic_error if the dictionary is embedded
+	 */
+	void add_word(const string& word, size_t count = 1) {
 		string converted;
 
 		for (char c : word) {
 			converted.push_back(digit[static_cast<size_t>(c)]);
 		}
 
-		//unordered_set will silently ignore duplicates
-		data[converted].insert(word);
+		if (compressed) {
+			update_packed(converted, word, count);
+			return;
+		}
+
+		if (!pool) {
+			data[converted][word] += count;
+			return;
+		}
+
+		auto& candidates = pooled_data[converted];
+		const word_pool::entry* pooled = pool->acquire(word);
+		auto inserted = candidates.emplace(pooled, 0);
+		if (!inserted.second) {
+			//a duplicate, the dictionary already holds a reference to the word
+			pool->release(pooled);
+		}
+		inserted.first->second += count;
 	}
 
-	const unordered_set<string>& get(const string& in) const {
-		auto it = data.find(in);
-		if (it == data.end()) {
-			return not_found;
+	/**
+	 * Removes all occurrences of a word made of lowercase letters.
+	 * In the compressed storage mode this rewrites the list of the word's digit sequence.
+	 * @return false if there was no such word
+	 * @throws logic_error if the dictionary is embedded
+	 */
+	bool remove_word(const string& word) {
+		string converted;
+
+		for (char c : word) {
+			converted.push_back(digit[static_cast<size_t>(c)]);
+		}
+
+		if (compressed) {
+			return update_packed(converted, word, 0);
+		}
+
+		if (!pool) {
+			auto it = data.find(converted);
+			if (it == data.end() || !it->second.erase(word)) {
+				return false;
+			}
+			if (it->second.empty()) {
+				data.erase(it);
+			}
+			return true;
+		}
+
+		auto it = pooled_data.find(converted);
+		const word_pool::entry* pooled = pool->find(word);
+		if (it == pooled_data.end() || !pooled || !it->second.erase(pooled)) {
+			return false;
+		}
+		pool->release(pooled);
+		if (it->second.empty()) {
+			pooled_data.erase(it);
+		}
+		return true;
+	}
+
+	/**
+	 * Returns the number of bytes used by a single packed word of given length.
+	 */
+	static size_t packed_width(size_t length) {
+		return (length + 3) / 4;
+	}
+
+	/**
+	 * Backs the arrays of the compressed storage with huge pages of the given size, 2 MB or 1 GB,
+	 * to spare the TLB on random lookups. Has to be called before `compress`.
+	 * Each time an array grows it maps a new region rounded up to the page size, so building the
+	 * compressed storage reserves its arrays once, but words added or removed afterwards may still
+	 * remap a whole array, which with 1 GB pages is a whole gigabyte.
+	 * @throws logic_error if the dictionary is already compressed
+	 */
+	void use_huge_pages(size_t page_size) {
+		if (compressed) {
+			throw logic_error("dictionary is compressed");
+		}
+		arena = decltype(arena)(huge_page_allocator<unsigned char>(page_size));
+		frequencies = decltype(frequencies)(huge_page_allocator<size_t>(page_size));
+	}
+
+	/**
+	 * Switches the dictionary to the compressed storage mode.
+	 * Afterwards every word added or removed rewrites the list of its digit sequence.
+	 */
+	void compress() {
+		if (compressed) {
+			return;
+		}
+
+		if (pool) {
+			pack_all(pooled_data);
+		} else {
+			pack_all(data);
+		}
+
+		//packed words are not shared
+		release_words();
+		data.clear();
+		pooled_data.clear();
+	}
+
+	/**
+	 * Reserves the compressed storage for `words` more candidates taking `bytes` of the arena
+	 * in total, so that adding them with `add_packed` does not reallocate it.
+	 * @throws logic_error if the dictionary is not compressed
+	 */
+	void reserve_packed(size_t bytes, size_t words) {
+		if (!compressed) {
+			throw logic_error("dictionary is not compressed");
+		}
+		arena.reserve(arena.size() + bytes);
+		reserved_words = packed_words + words;
+		if (!frequencies.empty()) {
+			frequencies.reserve(reserved_words);
+		}
+	}
+
+	/**
+	 * Adds a digit sequence that is not in the compressed dictionary yet, together with all its candidates.
+	 * `candidates` are distinct words with their number of occurrences; they get reordered.
+	 * @throws logic_error if the dictionary is not compressed
+	 */
+	void add_packed(string_view key, vector<pair<string_view, size_t>>& candidates) {
+		if (!compressed) {
+			throw logic_error("dictionary is not compressed");
+		}
+		if (embedded) {
+			throw logic_error("dictionary is embedded");
+		}
+
+		sort(candidates.begin(), candidates.end(), more_frequent);
+
+		size_t width = packed_width(key.size());
+		packed_data.emplace(key, packed_list {arena.size(), packed_words, candidates.size()});
+		arena.resize(arena.size() + candidates.size() * width);
+		unsigned char* out = arena.data() + arena.size() - candidates.size() * width;
+		for (const auto& candidate : candidates) {
+			pack(candidate.first, out);
+			out += width;
+
+			if (candidate.second != 1 && frequencies.empty()) {
+				frequencies.reserve(max(reserved_words, packed_words + candidates.size()));
+				frequencies.assign(packed_words, 1);
+			}
+			if (!frequencies.empty()) {
+				frequencies.push_back(candidate.second);
+			}
+			++packed_words;
+		}
+	}
+
+	/**
+	 * Writes the compressed dictionary as C++ definitions of constant arrays, ending with
+	 * an embedded_index named `t9_embedded`, to be compiled into a program.
+	 * @throws logic_error if the dictionary is not compressed
+	 */
+	void write_embedded(ostream& os) const {
+		if (!compressed) {
+			throw logic_error("dictionary is not compressed");
+		}
+
+		vector<pair<string_view, const packed_list*>> lists;
+		if (embedded) {
+			for (size_t i = 0; i < embedded->size; ++i) {
+				lists.emplace_back(embedded_key(i), &embedded->lists[i]);
+			}
 		} else {
-			return it->second;
+			for (const auto& p : packed_data) {
+				lists.emplace_back(p.first, &p.second);
+			}
+		}
+		sort(lists.begin(), lists.end());
+		bool counted = embedded ? embedded->frequencies != nullptr : !frequencies.empty();
+
+		//the arena is laid out anew, without the space left behind by updates
+		vector<uint32_t> key_offsets = { 0 };
+		vector<packed_list> new_lists;
+		vector<unsigned> codes;
+		vector<size_t> counts;
+		for (const auto& p : lists) {
+			key_offsets.push_back(key_offsets.back() + p.first.size());
+			size_t width = packed_width(p.first.size());
+			new_lists.push_back( { codes.size(), counts.size(), p.second->size });
+			const unsigned char* first = packed_arena() + p.second->offset;
+			codes.insert(codes.end(), first, first + p.second->size * width);
+			for (size_t i = 0; counted && i < p.second->size; ++i) {
+				counts.push_back(frequency(p.second->index + i));
+			}
+		}
+
+		//arrays get a trailing element, as they cannot be empty
+		auto write_array = [&os](const char* type, const char* name, const auto& values) {
+			os << "constexpr " << type << " " << name << "[] = {";
+			for (size_t i = 0; i < values.size(); ++i) {
+				os << (i % 16 ? " " : "\n\t") << values[i] << ",";
+			}
+			os << "\n\t0\n};\n\n";
+		};
+
+		os << "//generated by t9 -g, do not edit\n\n";
+		os << "constexpr char t9_embedded_keys[] =\n\t\"";
+		for (size_t i = 0; i < lists.size(); ++i) {
+			os << lists[i].first << (i % 16 == 15 ? "\"\n\t\"" : "");
+		}
+		os << "\";\n\n";
+		write_array("uint32_t", "t9_embedded_key_offsets", key_offsets);
+		os << "constexpr T9_dictionary::packed_list t9_embedded_lists[] = {";
+		for (const packed_list& list : new_lists) {
+			os << "\n\t{ " << list.offset << ", " << list.index << ", " << list.size << " },";
+		}
+		os << "\n\t{ 0, 0, 0 }\n};\n\n";
+		write_array("unsigned char", "t9_embedded_arena", codes);
+		if (counted) {
+			write_array("size_t", "t9_embedded_frequencies", counts);
+		}
+		os << "constexpr T9_dictionary::embedded_index t9_embedded = { t9_embedded_keys, t9_embedded_key_offsets,\n"
+				<< "\tt9_embedded_lists, " << lists.size() << ", t9_embedded_arena, "
+				<< (counted ? "t9_embedded_frequencies" : "nullptr") << " };\n";
+	}
+
+	/**
+	 * Returns true if the dictionary is in the compressed storage mode.
+	 * Otherwise the words passed to the callbacks of `get` stay valid until the dictionary is modified.
+	 */
+	bool is_compressed() const {
+		return compressed;
+	}
+
+	/**
+	 * Returns the approximate number of bytes used by this dictionary,
+	 * including its share of the words stored in the pool.
+	 */
+	size_t memory_usage() const {
+		size_t total = sizeof(*this) + table_bytes(data) + table_bytes(pooled_data) + table_bytes(packed_data)
+				+ arena.capacity() + frequencies.capacity() * sizeof(size_t);
+		for (const auto& p : data) {
+			total += heap_bytes(p.first) + table_bytes(p.second);
+			for (const auto& candidate : p.second) {
+				total += heap_bytes(candidate.first);
+			}
+		}
+		for (const auto& p : pooled_data) {
+			total += heap_bytes(p.first) + table_bytes(p.second);
+			for (const auto& candidate : p.second) {
+				const word_pool::entry* word = candidate.first;
+				total += (sizeof(*word) + heap_bytes(word->first)) / word->second;
+			}
+		}
+		for (const auto& p : packed_data) {
+			total += heap_bytes(p.first);
+		}
+		return total;
+	}
+
+	/**
+	 * Calls `f(word, count)` for every word that matches the given digit sequence,
+	 * where `word` is a `string_view` valid only during the call and `count` is the number
+	 * of times the word was added. Does not allocate memory once the buffers it reuses
+	 * have grown to the largest page.
+	 * Words are ordered the most frequent first and alphabetically among equally frequent ones,
+	 * in both storage modes. Only the page of at most `limit` words starting with the word
+	 * at `offset` in this order is visited.
+	 * @return false if there is no such word or `offset` is past the last one
+	 */
+	template<typename function>
+	bool get(string_view in, function f, size_t offset = 0, size_t limit = SIZE_MAX) const {
+		if (!compressed) {
+			return pool ? get_unpacked(pooled_data, in, f, offset, limit) : get_unpacked(data, in, f, offset, limit);
+		}
+
+		const packed_list* list = find_packed(in);
+		if (!list || offset >= list->size) {
+			return false;
+		}
+		visit(in, *list, f, offset, limit);
+		return true;
+	}
+
+	/**
+	 * Same as `get(string_view(in, length), f, offset, limit)`.
+	 */
+	template<typename function>
+	bool get(const char* in, size_t length, function f, size_t offset = 0, size_t limit = SIZE_MAX) const {
+		return get(string_view(in, length), f, offset, limit);
+	}
+
+	/**
+	 * Looks up a batch of digit sequences, overlapping the cache misses of independent queries:
+	 * all of them are hashed and their entries prefetched before any is searched.
+	 * Calls `f(i, word, count)` for every word matching `in[i]` and `missing(i)` if there is none
+	 * or `offset` is past the last one, query by query in order.
+	 * The arguments of `f`, `offset` and `limit` are as in `get`.
+	 */
+	template<typename function, typename missing_function>
+	void get_many(span<const string_view> in, function f, missing_function missing, size_t offset = 0,
+			size_t limit = SIZE_MAX) const {
+		for (size_t first = 0; first < in.size(); first += prefetch_batch) {
+			size_t n = min(prefetch_batch, in.size() - first);
+			const string_view* batch = in.data() + first;
+
+			if (!compressed) {
+				if (pool) {
+					get_many_unpacked(pooled_data, batch, n, first, f, missing, offset, limit);
+				} else {
+					get_many_unpacked(data, batch, n, first, f, missing, offset, limit);
+				}
+			} else {
+				const packed_list* found[prefetch_batch];
+				if (embedded) {
+					for (size_t i = 0; i < n; ++i) {
+						found[i] = find_packed(batch[i]);
+					}
+				} else {
+					find_many(packed_data, batch, n, found);
+				}
+				for (size_t i = 0; i < n; ++i) {
+					if (found[i] && offset < found[i]->size) {
+						__builtin_prefetch(packed_arena() + found[i]->offset + offset * packed_width(batch[i].size()));
+					}
+				}
+				for (size_t i = 0; i < n; ++i) {
+					if (found[i] && offset < found[i]->size) {
+						visit(batch[i], *found[i], [&f, i, first](string_view word, size_t count) {
+							f(first + i, word, count);
+						}, offset, limit);
+					} else {
+						missing(first + i);
+					}
+				}
+			}
+		}
+	}
+
+private:
+	/**
+	 * Adds `count` occurrences of a word to the compressed storage, or removes it if `count` is 0.
+	 * The list of the digit sequence is decoded, changed and appended anew to the arena.
+	 * The space left behind is reclaimed by compacting the arena once it makes up half of it,
+	 * so the cost of an update is proportional to the size of the list, amortized.
+	 * @return false if a word to remove was not there
+	 */
+	bool update_packed(const string& key, const string& word, size_t count) {
+		if (embedded) {
+			throw logic_error("dictionary is embedded");
+		}
+		auto it = packed_data.find(key);
+
+		vector<pair<string, size_t>> words;
+		if (it != packed_data.end()) {
+			visit(key, it->second, [&words](string_view w, size_t c) {
+				words.emplace_back(w, c);
+			}, 0, SIZE_MAX);
+		}
+
+		auto found = find_if(words.begin(), words.end(), [&word](const pair<string, size_t>& w) {
+			return w.first == word;
+		});
+		if (count == 0) {
+			if (found == words.end()) {
+				return false;
+			}
+			words.erase(found);
+		} else if (found == words.end()) {
+			words.emplace_back(word, count);
+		} else {
+			found->second += count;
+		}
+
+		if (it != packed_data.end()) {
+			garbage += it->second.size * packed_width(key.size());
+			packed_data.erase(it);
+		}
+		if (!words.empty()) {
+			vector<pair<string_view, size_t>> candidates(words.begin(), words.end());
+			add_packed(key, candidates);
+		}
+
+		if (2 * garbage > arena.size()) {
+			compact();
+		}
+		return true;
+	}
+
+	//moves the lists of all keys back to back, dropping space no longer used
+	void compact() {
+		decltype(arena) old_arena(arena.get_allocator());
+		decltype(frequencies) old_frequencies(frequencies.get_allocator());
+		old_arena.swap(arena);
+		old_frequencies.swap(frequencies);
+		arena.reserve(old_arena.size() - garbage);
+		packed_words = 0;
+
+		for (auto& p : packed_data) {
+			packed_list& list = p.second;
+			size_t width = packed_width(p.first.size());
+			const unsigned char* first = old_arena.data() + list.offset;
+			size_t offset = arena.size();
+			arena.insert(arena.end(), first, first + list.size * width);
+			if (!old_frequencies.empty()) {
+				frequencies.insert(frequencies.end(), old_frequencies.begin() + list.index,
+						old_frequencies.begin() + list.index + list.size);
+			}
+			list = {offset, packed_words, list.size};
+			packed_words += list.size;
+		}
+		garbage = 0;
+	}
+
+	static constexpr size_t prefetch_batch = 16;
+
+	template<typename map_type>
+	void pack_all(const map_type& m) {
+		size_t bytes = 0;
+		size_t words = 0;
+		for (const auto& p : m) {
+			bytes += p.second.size() * packed_width(p.first.size());
+			words += p.second.size();
+		}
+		packed_data.reserve(m.size());
+		compressed = true;
+		reserve_packed(bytes, words);
+
+		vector<pair<string_view, size_t>> candidates;
+		for (const auto& p : m) {
+			candidates.clear();
+			for (const auto& candidate : p.second) {
+				candidates.emplace_back(word_of(candidate.first), candidate.second);
+			}
+			add_packed(p.first, candidates);
+		}
+	}
+
+	template<typename map_type, typename function>
+	static bool get_unpacked(const map_type& m, string_view in, function& f, size_t offset, size_t limit) {
+		auto it = m.find(in);
+		if (it == m.end() || offset >= it->second.size()) {
+			return false;
+		}
+		visit(it->second, f, offset, limit);
+		return true;
+	}
+
+	//the queries of `get_many` from `first` to `first + n`
+	template<typename map_type, typename function, typename missing_function>
+	static void get_many_unpacked(const map_type& m, const string_view* batch, size_t n, size_t first, function& f,
+			missing_function& missing, size_t offset, size_t limit) {
+		const typename map_type::mapped_type* found[prefetch_batch];
+		find_many(m, batch, n, found);
+		for (size_t i = 0; i < n; ++i) {
+			if (found[i] && !found[i]->empty()) {
+				__builtin_prefetch(&*found[i]->begin());
+			}
+		}
+		for (size_t i = 0; i < n; ++i) {
+			if (found[i] && offset < found[i]->size()) {
+				visit(*found[i], [&f, i, first](string_view word, size_t count) {
+					f(first + i, word, count);
+				}, offset, limit);
+			} else {
+				missing(first + i);
+			}
+		}
+	}
+
+	static string_view word_of(const string& word) {
+		return word;
+	}
+
+	static string_view word_of(const word_pool::entry* word) {
+		return word->first;
+	}
+
+	//finds `n` keys, prefetching the entries of all of them before searching for any
+	template<typename map_type>
+	static void find_many(const map_type& m, const string_view* in, size_t n,
+			const typename map_type::mapped_type** out) {
+		//the bucket as chosen by the usual modulo range hashing,
+		//an implementation that does it differently only wastes the prefetch
+		size_t buckets[prefetch_batch];
+		for (size_t i = 0; i < n; ++i) {
+			buckets[i] = key_hash()(in[i]) % m.bucket_count();
+		}
+		for (size_t i = 0; i < n; ++i) {
+			auto it = m.begin(buckets[i]);
+			if (it != m.end(buckets[i])) {
+				__builtin_prefetch(&*it);
+			}
+		}
+		for (size_t i = 0; i < n; ++i) {
+			auto it = m.find(in[i]);
+			out[i] = it != m.end() ? &it->second : nullptr;
+		}
+	}
+
+	//the order of candidates in both storage modes
+	static bool more_frequent(const pair<string_view, size_t>& a, const pair<string_view, size_t>& b) {
+		return a.second != b.second ? a.second > b.second : a.first < b.first;
+	}
+
+	//hashed candidates are ordered as packed ones, sorting only as far as the end of the page
+	template<typename map_type, typename function>
+	static void visit(const map_type& candidates, function&& f, size_t offset, size_t limit) {
+		if (offset >= candidates.size()) {
+			return;
+		}
+		//reused, so it only grows for the most candidates seen so far
+		thread_local vector<pair<string_view, size_t>> ordered;
+		ordered.clear();
+		for (const auto& candidate : candidates) {
+			ordered.emplace_back(word_of(candidate.first), candidate.second);
+		}
+		size_t last = offset + min(limit, ordered.size() - offset);
+		partial_sort(ordered.begin(), ordered.begin() + last, ordered.end(), more_frequent);
+		for (size_t i = offset; i < last; ++i) {
+			f(ordered[i].first, ordered[i].second);
+		}
+	}
+
+	//packed words can be accessed at random, so the words before the page are not touched
+	template<typename function>
+	void visit(string_view key, const packed_list& list, function&& f, size_t offset, size_t limit) const {
+		if (offset >= list.size) {
+			return;
+		}
+		size_t last = offset + min(limit, list.size - offset);
+		size_t width = packed_width(key.size());
+		const unsigned char* code = packed_arena() + list.offset + offset * width;
+		//reused, so it only grows for the longest key seen so far
+		thread_local string word;
+		word.resize(key.size());
+		for (size_t i = offset; i < last; ++i, code += width) {
+			unpack(key, code, word);
+			f(string_view(word), frequency(list.index + i));
+		}
+	}
+
+	const unsigned char* packed_arena() const {
+		return embedded ? embedded->arena : arena.data();
+	}
+
+	size_t frequency(size_t index) const {
+		if (embedded) {
+			return embedded->frequencies ? embedded->frequencies[index] : 1;
+		}
+		return frequencies.empty() ? 1 : frequencies[index];
+	}
+
+	string_view embedded_key(size_t i) const {
+		return string_view(embedded->keys + embedded->key_offsets[i], embedded->key_offsets[i + 1] - embedded->key_offsets[i]);
+	}
+
+	const packed_list* find_packed(string_view key) const {
+		if (!embedded) {
+			auto it = packed_data.find(key);
+			return it != packed_data.end() ? &it->second : nullptr;
+		}
+
+		size_t first = 0;
+		size_t last = embedded->size;
+		while (first < last) {
+			size_t middle = first + (last - first) / 2;
+			if (embedded_key(middle) < key) {
+				first = middle + 1;
+			} else {
+				last = middle;
+			}
+		}
+		return first < embedded->size && embedded_key(first) == key ? &embedded->lists[first] : nullptr;
+	}
+
+	void release_words() {
+		for (const auto& p : pooled_data) {
+			for (const auto& candidate : p.second) {
+				pool->release(candidate.first);
+			}
 		}
 	}
 };
 
-const unordered_set<string> T9_dictionary::not_found = { "BRAK" };
+#ifdef T9_EMBEDDED
+//the dictionary written by -g, e.g. compiled with -DT9_EMBEDDED='"slownik.hpp"'
+#include T9_EMBEDDED
+#endif
 
-int main() {
-	T9_dictionary dict;
-	ifstream fin("slownik.txt");
+/**
+ * Several named dictionaries, sharing one word pool if there are to be more than one.
+ */
+class T9_registry {
+public:
+	/**
+	 * Without `shared` words are not pooled, which saves the cost of interning them
+	 * when the registry is going to hold a single dictionary.
+	 */
+	explicit T9_registry(bool shared = true) :
+			pool(shared ? make_shared<word_pool>() : nullptr) {
+	}
+
+	/**
+	 * Returns the dictionary with the given name, creating an empty one if needed.
+	 */
+	T9_dictionary& add(const string& name) {
+		return dictionaries.emplace(piecewise_construct, forward_as_tuple(name), forward_as_tuple(pool)).first->second;
+	}
+
+	/**
+	 * Adds a dictionary with the given name that reads its words from the embedded index,
+	 * unless there is one with that name already.
+	 */
+	T9_dictionary& add(const string& name, const T9_dictionary::embedded_index& index) {
+		return dictionaries.emplace(piecewise_construct, forward_as_tuple(name), forward_as_tuple(index)).first->second;
+	}
+
+	/**
+	 * Returns the dictionary with the given name or nullptr if there is none.
+	 */
+	const T9_dictionary* find(string_view name) const {
+		auto it = dictionaries.find(name);
+		return it != dictionaries.end() ? &it->second : nullptr;
+	}
+
+	T9_dictionary* find(string_view name) {
+		auto it = dictionaries.find(name);
+		return it != dictionaries.end() ? &it->second : nullptr;
+	}
+
+	const key_map<T9_dictionary>& all() const {
+		return dictionaries;
+	}
+
+	/**
+	 * Returns the number of bytes used by the shared words.
+	 */
+	size_t shared_memory_usage() const {
+		return pool ? pool->memory_usage() : 0;
+	}
+
+private:
+	shared_ptr<word_pool> pool; //nullptr if words are not shared
+	key_map<T9_dictionary> dictionaries;
+};
+
+/**
+ * A least recently used cache of formatted query results, limited by the number of bytes it holds.
+ * Split into independently locked shards so it can be used from many threads.
+ */
+class query_cache {
+public:
+	explicit query_cache(size_t capacity, size_t shard_count = 16) :
+			shards(shard_count) {
+		for (shard& s : shards) {
+			s.capacity = capacity / shard_count;
+		}
+	}
+
+	/**
+	 * Returns the cached result for the key or nullptr on a miss.
+	 */
+	shared_ptr<const string> find(const string& key) {
+		shard& s = shard_for(key);
+		lock_guard<mutex> lock(s.m);
+		auto it = s.index.find(key);
+		if (it == s.index.end()) {
+			++misses;
+			return nullptr;
+		}
+		++hits;
+		s.entries.splice(s.entries.begin(), s.entries, it->second);
+		return it->second->second;
+	}
+
+	/**
+	 * Stores the result for the key, evicting the least recently used ones to make room.
+	 */
+	void insert(const string& key, string value) {
+		size_t size = entry_size(key, value);
+		shard& s = shard_for(key);
+		if (size > s.capacity) {
+			return;
+		}
+
+		lock_guard<mutex> lock(s.m);
+		if (s.index.count(key)) {
+			return;
+		}
+		while (s.size + size > s.capacity) {
+			auto& last = s.entries.back();
+			s.size -= entry_size(last.first, *last.second);
+			s.index.erase(last.first);
+			s.entries.pop_back();
+		}
+		s.entries.emplace_front(key, make_shared<const string>(move(value)));
+		s.index[key] = s.entries.begin();
+		s.size += size;
+	}
+
+	size_t hit_count() const {
+		return hits;
+	}
+
+	size_t miss_count() const {
+		return misses;
+	}
+
+private:
+	using entry = pair<string, shared_ptr<const string>>;
+
+	struct shard {
+		mutex m;
+		list<entry> entries; //most recently used first
+		unordered_map<string, list<entry>::iterator> index;
+		size_t size = 0;
+		size_t capacity = 0;
+	};
+
+	vector<shard> shards;
+	atomic<size_t> hits { 0 };
+	atomic<size_t> misses { 0 };
+
+	shard& shard_for(const string& key) {
+		return shards[hash<string>()(key) % shards.size()];
+	}
+
+	//the bytes of both strings plus the list node, the index node and the shared string
+	static size_t entry_size(const string& key, const string& value) {
+		return 2 * key.size() + value.size() + sizeof(entry) + sizeof(string) + 8 * sizeof(void*);
+	}
+};
+
+/**
+ * Reads words from stdin and writes their digit sequences to stdout, one per line.
+ * If `distinct` is set, every digit sequence is written once, followed by its number of occurrences
+ * if `counts` is set.
+ * @return the exit code of main
+ */
+int encode_stream(const T9_dictionary& dict, bool distinct, bool counts) {
+	vector<char> buffer(1 << 20);
+	hash_counter counter;
+	size_t carry = 0; //an unfinished line at the front of the buffer
+
+	size_t n;
+	while ((n = fread(buffer.data() + carry, 1, buffer.size() - carry, stdin)) > 0) {
+		char* first = buffer.data() + carry;
+		char* last = first + n;
+		if (!dict.encode(first, last)) {
+			cerr << "niewlasciwy format wejscia\n";
+			return 3;
+		}
+
+		if (!distinct) {
+			fwrite(first, 1, n, stdout);
+			continue;
+		}
+
+		char* line = buffer.data();
+		for (char* end; (end = static_cast<char*>(memchr(line, '\n', last - line))); line = end + 1) {
+			if (end != line) {
+				counter.add(line, end - line);
+			}
+		}
+		carry = last - line;
+		memmove(buffer.data(), line, carry);
+		if (carry == buffer.size()) {
+			buffer.resize(2 * buffer.size());
+		}
+	}
+	if (carry) {
+		counter.add(buffer.data(), carry);
+	}
+
+	counter.for_each([counts](const char* key, size_t length, size_t count) {
+		fwrite(key, 1, length, stdout);
+		if (counts) {
+			printf(" %zu", count);
+		}
+		putchar('\n');
+	});
+	return 0;
+}
+
+/**
+ * Adds every word from the file to the dictionary.
+ * If `counted` is set, duplicates are counted first and every distinct word is added once with its count.
+ * @return the exit code of main
+ */
+int load(T9_dictionary& dict, const string& path, bool counted) {
+	ifstream fin(path);
 
 	if (!fin) {
-		cerr << "nie udalo sie wczytac pliku slownik.txt\n";
+		cerr << "nie udalo sie wczytac pliku " << path << "\n";
 		return 1;
 	}
 
+	hash_counter counter;
 	string line;
 	while (getline(fin, line)) {
 		if (line.empty()
 				|| find_if_not(line.begin(), line.end(), [](char c) {return islower(c);}) != line.end()) {
-			cerr << "niewlasciwy format pliku slownik.txt\n";
+			cerr << "niewlasciwy format pliku " << path << "\n";
 			return 2;
 		}
 
-		dict.add_word(line);
+		if (counted) {
+			counter.add(line.data(), line.size());
+		} else {
+			dict.add_word(line);
+		}
+	}
+
+	counter.for_each([&dict](const char* word, size_t length, size_t count) {
+		dict.add_word(string(word, length), count);
+	});
+	return 0;
+}
+
+/**
+ * Applies the changes from the file to the dictionary.
+ * Every line of the file is a word preceded by '+' to add it or by '-' to remove it.
+ * @return the exit code of main
+ */
+int apply_delta(T9_dictionary& dict, const string& path) {
+	ifstream fin(path);
+
+	if (!fin) {
+		cerr << "nie udalo sie wczytac pliku " << path << "\n";
+		return 1;
 	}
 
-	while (getline(cin, line)) {
+	string line;
+	string word;
+	while (getline(fin, line)) {
+		if (line.size() < 2 || (line[0] != '+' && line[0] != '-')
+				|| find_if_not(line.begin() + 1, line.end(), [](char c) {return islower(c);}) != line.end()) {
+			cerr << "niewlasciwy format pliku " << path << "\n";
+			return 2;
+		}
+
+		word.assign(line, 1);
+		try {
+			if (line[0] == '+') {
+				dict.add_word(word);
+			} else {
+				dict.remove_word(word);
+			}
+		} catch (const logic_error&) {
+			cerr << "slownika nie mozna zmieniac\n";
+			return 4;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Builds a compressed dictionary from a word list that does not fit in memory.
+ * Every word is stored as a record of its digit sequence followed by the word itself.
+ * Records are sorted in runs of about `memory_limit` bytes, written back to back to a temporary file.
+ * Runs are merged at most `merge_width` at a time, each read through a buffer of its share
+ * of the limit, in passes that write the merged runs to another temporary file,
+ * until the last pass merges them straight into the compressed storage. So the memory used
+ * apart from the dictionary itself stays within the limit and only two files are open,
+ * however large the input is.
+ * Sorting the records groups them by digit sequence: all words of a sequence have its length,
+ * and a digit always sorts before a letter.
+ * A temporary file that cannot be written or read back in full is an error, with exit code 7.
+ * @return the exit code of main
+ */
+int load_external(T9_dictionary& dict, const string& path, size_t memory_limit) {
+	ifstream fin(path);
+
+	if (!fin) {
+		cerr << "nie udalo sie wczytac pliku " << path << "\n";
+		return 1;
+	}
+
+	struct record_ref {
+		size_t offset; //into records
+		size_t length;
+	};
+
+	//the limit is split evenly between the records and their references, both reserved up front,
+	//so neither of them overshoots it by growing
+	string records;
+	vector<record_ref> refs;
+	records.reserve(memory_limit / 2);
+	refs.reserve(max<size_t>(1, memory_limit / 2 / sizeof(record_ref)));
+	//of the compressed storage, counting duplicates too, so it is sized once for the merge
+	size_t packed_bytes = 0;
+	size_t packed_words = 0;
+
+	//a run is the bytes [first, last) of the file holding the runs of a pass
+	struct run {
+		off_t first;
+		off_t last;
+	};
+	using run_file = unique_ptr<FILE, int (*)(FILE*)>;
+	run_file file(nullptr, fclose);
+	off_t file_size = 0;
+	vector<run> runs;
+
+	auto create = [](run_file& f) {
+		f.reset(tmpfile());
+		if (!f) {
+			cerr << "nie udalo sie utworzyc pliku tymczasowego\n";
+			return 5;
+		}
+		return 0;
+	};
+	auto write_error = []() {
+		cerr << "nie udalo sie zapisac pliku tymczasowego\n";
+		return 7;
+	};
+	auto read_error = []() {
+		cerr << "nie udalo sie odczytac pliku tymczasowego\n";
+		return 7;
+	};
+	//writes a record with its count as its length, the record and the count
+	auto write_record = [](FILE* f, off_t& size, string_view record, size_t count) {
+		size_t length = record.size() / 2;
+		size += sizeof(length) + record.size() + sizeof(count);
+		return fwrite(&length, sizeof(length), 1, f) == 1
+				&& fwrite(record.data(), 1, record.size(), f) == record.size()
+				&& fwrite(&count, sizeof(count), 1, f) == 1;
+	};
+
+	//sorts the buffered records and appends them to the file as a run, as records with their counts
+	//@return the exit code of main
+	auto spill = [&]() {
+		auto view = [&records](const record_ref& r) {
+			return string_view(records).substr(r.offset, r.length);
+		};
+		sort(refs.begin(), refs.end(), [&view](const record_ref& a, const record_ref& b) {
+			return view(a) < view(b);
+		});
+
+		if (!file) {
+			if (int error = create(file)) {
+				return error;
+			}
+		}
+		run r = { file_size, 0 };
+		bool written = true;
+		for (size_t i = 0, j; i < refs.size() && written; i = j) {
+			string_view record = view(refs[i]);
+			for (j = i + 1; j < refs.size() && view(refs[j]) == record; ++j) {
+			}
+			written = write_record(file.get(), file_size, record, j - i);
+		}
+		if (!written || fflush(file.get()) != 0 || ferror(file.get())) {
+			return write_error();
+		}
+		r.last = file_size;
+		runs.push_back(r);
+
+		records.clear();
+		refs.clear();
+		return 0;
+	};
+
+	string line;
+	while (getline(fin, line)) {
 		if (line.empty()
-				|| find_if_not(line.begin(), line.end(), [](char c) {return isdigit(c);}) != line.end()) {
-			cerr << "niewlasciwy format wejscia\n";
-			return 3;
+				|| find_if_not(line.begin(), line.end(), [](char c) {return islower(c);}) != line.end()) {
+			cerr << "niewlasciwy format pliku " << path << "\n";
+			return 2;
+		}
+
+		//a record that does not fit is spilled with the next run, one too long for any run grows it
+		if (!refs.empty() && (records.size() + 2 * line.size() > records.capacity() || refs.size() == refs.capacity())) {
+			if (int error = spill()) {
+				return error;
+			}
+		}
+
+		packed_bytes += T9_dictionary::packed_width(line.size());
+		++packed_words;
+		refs.push_back( { records.size(), 2 * line.size() });
+		records += line;
+		dict.encode(records.data() + records.size() - line.size(), records.data() + records.size());
+		records += line;
+	}
+	if (!refs.empty()) {
+		if (int error = spill()) {
+			return error;
+		}
+	}
+	string().swap(records);
+	vector<record_ref>().swap(refs);
+
+	//the limit now goes to the read buffers of the runs merged at once, which are kept large enough
+	//for reading to take few calls
+	const size_t merge_width = clamp<size_t>(memory_limit / (1 << 16), 2, 64);
+	const size_t buffer_size = max<size_t>(1, memory_limit / merge_width);
+
+	//a run read back through a buffer of its own, by position, so all runs share one file
+	struct run_reader {
+		int fd;
+		run r;
+		string buffer;
+		size_t first = 0;
+		size_t last = 0;
+		bool failed = false; //the run ended inside a record or could not be read
+
+		//@return false at the end of the run or if it failed, which it did unless nothing was read
+		//at the recorded end of the run
+		bool read(void* out, size_t n) {
+			char* to = static_cast<char*>(out);
+			while (n) {
+				if (first == last) {
+					size_t length = min<off_t>(buffer.size(), r.last - r.first);
+					ssize_t got = length ? pread(fd, buffer.data(), length, r.first) : 0;
+					if (got < 0 && errno == EINTR) {
+						continue;
+					}
+					if (got <= 0) {
+						failed = got < 0 || length != 0 || to != out;
+						return false;
+					}
+					r.first += got;
+					first = 0;
+					last = got;
+				}
+				size_t part = min(n, last - first);
+				memcpy(to, buffer.data() + first, part);
+				first += part;
+				to += part;
+				n -= part;
+			}
+			return true;
+		}
+	};
+
+	//the current record of every merged run
+	struct run_head {
+		run_reader reader;
+		string record;
+		size_t count;
+	};
+	vector<run_head> heads;
+	//@return false at the end of the run or on an error, which marks the reader as failed
+	auto advance = [&heads](size_t i) {
+		run_head& head = heads[i];
+		size_t length;
+		if (!head.reader.read(&length, sizeof(length))) {
+			return false;
+		}
+		head.record.resize(2 * length);
+		if (!head.reader.read(head.record.data(), 2 * length) || !head.reader.read(&head.count, sizeof(head.count))) {
+			head.reader.failed = true;
+			return false;
+		}
+		return true;
+	};
+
+	//merges runs [first, last) into f(record, count), which returns false on an error
+	//@return the exit code of main
+	auto merge = [&](size_t first, size_t last, auto&& f) {
+		heads.clear();
+		for (size_t i = first; i < last; ++i) {
+			heads.push_back( { { fileno(file.get()), runs[i], string(buffer_size, '\0') }, string(), 0 });
+		}
+		auto later = [&heads](size_t a, size_t b) {
+			return heads[a].record > heads[b].record;
+		};
+		priority_queue<size_t, vector<size_t>, decltype(later)> queue(later);
+		for (size_t i = 0; i < heads.size(); ++i) {
+			if (advance(i)) {
+				queue.push(i);
+			} else if (heads[i].reader.failed) {
+				return read_error();
+			}
+		}
+		while (!queue.empty()) {
+			size_t i = queue.top();
+			queue.pop();
+			if (!f(string_view(heads[i].record), heads[i].count)) {
+				return write_error();
+			}
+			if (advance(i)) {
+				queue.push(i);
+			} else if (heads[i].reader.failed) {
+				return read_error();
+			}
+		}
+		return 0;
+	};
+
+	//passes until the remaining runs can be merged at once
+	while (runs.size() > merge_width) {
+		run_file next(nullptr, fclose);
+		if (int error = create(next)) {
+			return error;
+		}
+		off_t next_size = 0;
+		vector<run> merged;
+		for (size_t first = 0; first < runs.size(); first += merge_width) {
+			run r = { next_size, 0 };
+			int error = merge(first, min(runs.size(), first + merge_width), [&](string_view record, size_t count) {
+				return write_record(next.get(), next_size, record, count);
+			});
+			if (error) {
+				return error;
+			}
+			r.last = next_size;
+			merged.push_back(r);
+		}
+		if (fflush(next.get()) != 0 || ferror(next.get())) {
+			return write_error();
+		}
+		file = move(next);
+		runs = move(merged);
+	}
+
+	dict.compress();
+	dict.reserve_packed(packed_bytes, packed_words);
+
+	//the words of the current digit sequence, all of its length
+	string key;
+	string words;
+	vector<size_t> counts;
+	vector<pair<string_view, size_t>> candidates;
+	auto flush = [&]() {
+		candidates.clear();
+		for (size_t i = 0; i < counts.size(); ++i) {
+			candidates.emplace_back(string_view(words).substr(i * key.size(), key.size()), counts[i]);
+		}
+		if (!candidates.empty()) {
+			dict.add_packed(key, candidates);
+		}
+		words.clear();
+		counts.clear();
+	};
+
+	int error = merge(0, runs.size(), [&](string_view record, size_t count) {
+		size_t length = record.size() / 2;
+		string_view digits = record.substr(0, length);
+		string_view word = record.substr(length);
+		if (digits != key) {
+			flush();
+			key = digits;
+		}
+		//equal records of different runs come one after another
+		if (!counts.empty() && string_view(words).substr(words.size() - length) == word) {
+			counts.back() += count;
+		} else {
+			words += word;
+			counts.push_back(count);
+		}
+		return true;
+	});
+	if (error) {
+		return error;
+	}
+	flush();
+	return 0;
+}
+
+/**
+ * Collects the results of a batch of queries and writes them to stdout as binary records.
+ * A record is the number of candidates and the length of every one of them, as two 32 bit
+ * unsigned integers in host byte order, followed by the candidates back to back. A query without
+ * a match has no candidates. Records are written in the order of queries with writev,
+ * taking the words kept by the dictionary as strings straight from it.
+ */
+class binary_output {
+public:
+	void clear(size_t queries) {
+		headers.assign(queries, header { 0, 0 });
+		segments.clear();
+		scratch.clear();
+	}
+
+	/**
+	 * Adds a candidate to the result of the query, which must not precede a query with candidates added already.
+	 * A `stable` word has to stay valid until `write` and is not copied.
+	 */
+	void add(size_t query, string_view word, bool stable) {
+		headers[query].count++;
+		headers[query].length = word.size();
+		if (stable) {
+			segments.push_back( { word.data(), 0, word.size() });
+		} else {
+			segments.push_back( { nullptr, scratch.size(), word.size() });
+			scratch += word;
+		}
+	}
+
+	/**
+	 * Writes the records of the first `queries` queries.
+	 * @return false if writing failed
+	 */
+	bool write(size_t queries) {
+		iov.clear();
+		auto segment = segments.begin();
+		for (size_t i = 0; i < queries; ++i) {
+			iov.push_back( { &headers[i], sizeof(header) });
+			for (uint32_t j = 0; j < headers[i].count; ++j, ++segment) {
+				const char* base = segment->data ? segment->data : scratch.data() + segment->offset;
+				iov.push_back( { const_cast<char*>(base), segment->length });
+			}
+		}
+
+		iovec* first = iov.data();
+		size_t count = iov.size();
+		while (count) {
+			ssize_t written = writev(STDOUT_FILENO, first, min<size_t>(count, IOV_MAX));
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			//skip what was written, resuming a partially written buffer
+			for (; count && static_cast<size_t>(written) >= first->iov_len; ++first, --count) {
+				written -= first->iov_len;
+			}
+			if (count) {
+				first->iov_base = static_cast<char*>(first->iov_base) + written;
+				first->iov_len -= written;
+			}
+		}
+		return true;
+	}
+
+private:
+	struct header {
+		uint32_t count;
+		uint32_t length;
+	};
+
+	//a word, either kept by the dictionary or copied into scratch
+	struct segment {
+		const char* data;
+		size_t offset;
+		size_t length;
+	};
+
+	vector<header> headers;
+	vector<segment> segments;
+	string scratch;
+	vector<iovec> iov;
+};
+
+//a time stamp in ticks of the time stamp counter if there is one, in nanoseconds otherwise
+uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+//whether the next line of stdin is in its buffer whole, so reading it does not wait for input
+bool line_buffered() {
+#ifdef __GLIBC__
+	return memchr(stdin->_IO_read_ptr, '\n', stdin->_IO_read_end - stdin->_IO_read_ptr);
+#else
+	return false;
+#endif
+}
+
+/**
+ * Returns the number of ticks per nanosecond, measured since the first call.
+ */
+double ticks_per_nanosecond() {
+	static const uint64_t start_ticks = ticks();
+	static const auto start_time = chrono::steady_clock::now();
+	double elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+	return elapsed > 0 ? (ticks() - start_ticks) / elapsed : 1;
+}
+
+/**
+ * A histogram of durations with a bounded relative error, in the manner of HdrHistogram:
+ * small values are counted exactly, larger ones in `1 << (precision - 1)` linear buckets
+ * for every power of two. Recorded by a single thread, but can be read by any.
+ */
+class latency_histogram {
+public:
+	void record(uint64_t value) {
+		atomic<uint64_t>& c = counts[index(value)];
+		c.store(c.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	}
+
+	void merge_into(vector<uint64_t>& total) const {
+		total.resize(bucket_count);
+		for (size_t i = 0; i < bucket_count; ++i) {
+			total[i] += counts[i].load(memory_order_relaxed);
 		}
+	}
+
+	/**
+	 * Returns the upper bound of the values in the `p`-th percentile of merged counts.
+	 */
+	static uint64_t percentile(const vector<uint64_t>& total, double p) {
+		uint64_t all = 0;
+		for (uint64_t c : total) {
+			all += c;
+		}
+		uint64_t seen = 0;
+		for (size_t i = 0; i < total.size(); ++i) {
+			seen += total[i];
+			if (total[i] && seen >= p / 100 * all) {
+				return upper_bound(i);
+			}
+		}
+		return 0;
+	}
+
+private:
+	static constexpr int precision = 7;
+	static constexpr size_t half = 1 << (precision - 1);
+	static constexpr size_t bucket_count = 2 * half + (64 - precision) * half;
+
+	atomic<uint64_t> counts[bucket_count] = { };
+
+	static size_t index(uint64_t value) {
+		int shift = max(static_cast<int>(bit_width(value)) - precision, 0);
+		if (shift == 0) {
+			return value;
+		}
+		return 2 * half + (shift - 1) * half + ((value >> shift) - half);
+	}
+
+	static uint64_t upper_bound(size_t i) {
+		if (i < 2 * half) {
+			return i;
+		}
+		size_t shift = (i - 2 * half) / half + 1;
+		return ((((i - 2 * half) % half) + half + 1) << shift) - 1;
+	}
+};
+
+/**
+ * Durations of the stages of answering queries. Every thread records into its own histograms,
+ * which are merged when printed.
+ */
+class query_timer {
+public:
+	enum stage {
+		parse, //reading a line, validating it and looking it up in the cache, without waiting for input
+		lookup, //looking up and appending the candidates
+		write, //writing and caching the results of the batch of the query
+		cycle, //from reading a line to writing its result, without waiting for input
+		stage_count
+	};
+
+	/**
+	 * Records the duration in ticks of a stage of a single query.
+	 */
+	static void record(stage s, uint64_t duration) {
+		local().histograms[s].record(duration);
+	}
 
-		cout << line << ":";
-		for (const string& s : dict.get(line)) {
-			cout << " " << s;
+	static void print(ostream& os) {
+		static const char* const names[stage_count] = { "parse", "lookup", "write", "cycle" };
+		double rate = ticks_per_nanosecond();
+
+		lock_guard<mutex> lock(registry_mutex);
+		for (int s = 0; s < stage_count; ++s) {
+			vector<uint64_t> total;
+			for (const query_timer* timer : timers) {
+				timer->histograms[s].merge_into(total);
+			}
+			os << "czas " << names[s] << " [ns]:";
+			for (double p : { 50.0, 90.0, 99.0, 99.9, 100.0 }) {
+				os << " p" << p << "=" << static_cast<uint64_t>(latency_histogram::percentile(total, p) / rate);
+			}
+			os << "\n";
 		}
-		cout << "\n";
 	}
+
+private:
+	latency_histogram histograms[stage_count];
+
+	static mutex registry_mutex;
+	static vector<const query_timer*> timers; //of all threads, never freed so they can be printed at exit
+
+	static query_timer& local() {
+		thread_local query_timer* timer = [] {
+			query_timer* t = new query_timer;
+			lock_guard<mutex> lock(registry_mutex);
+			timers.push_back(t);
+			return t;
+		}();
+		return *timer;
+	}
+};
+
+mutex query_timer::registry_mutex;
+vector<const query_timer*> query_timer::timers;
+
+struct query_options {
+	bool binary = false; //results are written by binary_output
+	bool named = false; //queries are "name digits"
+	bool multitap = false; //digits are a multi-tap sequence, see T9_dictionary::decode_multitap
+	bool validate = false; //a decoded multi-tap sequence has to be in the dictionary
+	size_t offset = 0; //of the first candidate printed for a query
+	size_t limit = SIZE_MAX; //of candidates printed for a query
+	bool timed = false; //durations of the stages are recorded by query_timer
+};
+
+/**
+ * Answers the queries from stdin, a batch of lines at a time.
+ * @return the exit code of main
+ */
+int answer_queries(const T9_registry& registry, const query_options& options, query_cache* cache) {
+	const size_t batch_size = 64;
+	vector<string> lines(batch_size);
+	vector<string> results(batch_size);
+	vector<shared_ptr<const string>> cached(batch_size);
+
+	//lookups to do, with the dictionary and the line of every one
+	vector<string_view> queries;
+	vector<const T9_dictionary*> dicts;
+	vector<size_t> pending;
+	string word;
+	binary_output binary;
+
+	//time stamps of every line of the batch, taken if options.timed
+	//reading the time stamp counter is not free, so a query takes two of them: when it was parsed
+	//and when its lookup finished; getline is timed separately only when it may wait for input,
+	//and writing results is timed for the whole batch
+	struct line_times {
+		uint64_t read; //when the line was taken from the input
+		uint64_t waited; //for input for this line and the ones before it in the batch
+		uint64_t parsed;
+		uint64_t looked_up; //0 if the result was cached
+	};
+	vector<line_times> times(batch_size);
+	uint64_t parsed = 0; //the last time stamp of the reading loop
+	size_t looking_up = SIZE_MAX; //the line candidates are added to, whose lookup ends with the next line
+
+	//ends the lookup of the line candidates were added to last, if any, at time stamp t
+	auto looked_up = [&](uint64_t t) {
+		if (looking_up != SIZE_MAX) {
+			times[looking_up].looked_up = t;
+			looking_up = SIZE_MAX;
+		}
+	};
+
+	//adds a candidate to the result of a line
+	auto add = [&](size_t line, string_view candidate, bool stable) {
+		if (options.binary) {
+			binary.add(line, candidate, stable);
+		} else {
+			results[line] += ' ';
+			results[line] += candidate;
+		}
+		if (options.timed && line != looking_up) {
+			looked_up(ticks());
+			looking_up = line;
+		}
+	};
+	auto missing = [&](size_t line) {
+		if (!options.binary) {
+			results[line] += " BRAK";
+		}
+		if (options.timed) {
+			uint64_t t = ticks();
+			looked_up(t);
+			times[line].looked_up = t;
+		}
+	};
+
+	const T9_dictionary* single = registry.find("");
+
+	int error = 0;
+	for (bool more = true; more && !error;) {
+		queries.clear();
+		dicts.clear();
+		pending.clear();
+		if (options.binary) {
+			binary.clear(batch_size);
+		}
+
+		uint64_t waited = 0;
+		if (options.timed) {
+			parsed = ticks();
+		}
+		size_t n = 0;
+		for (; n < batch_size; ++n) {
+			bool wait = options.timed && !line_buffered();
+			bool got_line = static_cast<bool>(getline(cin, lines[n]));
+			if (options.timed) {
+				times[n].read = parsed;
+				if (wait) {
+					times[n].read = ticks();
+					waited += times[n].read - parsed;
+				}
+				times[n].waited = waited;
+				times[n].looked_up = 0;
+			}
+			if (!got_line) {
+				more = false;
+				break;
+			}
+			const string& line = lines[n];
+			if (cache && !options.binary && (cached[n] = cache->find(line))) {
+				if (options.timed) {
+					times[n].parsed = parsed = ticks();
+				}
+				continue;
+			}
+
+			const T9_dictionary* dict = single;
+			size_t start = 0;
+			if (options.named) {
+				start = line.find(' ');
+				dict = start != string::npos ? registry.find(string_view(line).substr(0, start)) : nullptr;
+				if (!dict) {
+					cerr << "nieznany slownik w zapytaniu " << line << "\n";
+					error = 3;
+					break;
+				}
+				++start;
+			}
+
+			auto valid = [&options](char c) {
+				return options.multitap ? (c >= '2' && c <= '9') || c == ' ' : isdigit(c);
+			};
+			if (start == line.size() || find_if_not(line.begin() + start, line.end(), valid) != line.end()) {
+				cerr << "niewlasciwy format wejscia\n";
+				error = 3;
+				break;
+			}
+
+			queries.push_back(string_view(line).substr(start));
+			dicts.push_back(dict);
+			pending.push_back(n);
+			results[n].assign(line);
+			results[n] += ':';
+			if (options.timed) {
+				times[n].parsed = parsed = ticks();
+			}
+		}
+
+		uint64_t lookup_start = options.timed ? ticks() : 0;
+		if (options.timed) {
+			for (size_t line : pending) {
+				//in case no candidate is on the page
+				times[line].looked_up = lookup_start;
+			}
+		}
+		if (options.multitap) {
+			for (size_t i = 0; i < queries.size(); ++i) {
+				if (dicts[i]->decode_multitap(queries[i], word) && (!options.validate || dicts[i]->contains(word))) {
+					add(pending[i], word, false);
+				} else {
+					missing(pending[i]);
+				}
+			}
+			if (options.timed) {
+				looked_up(ticks());
+			}
+		} else {
+			//consecutive queries to the same dictionary are looked up together
+			for (size_t first = 0, last; first < queries.size(); first = last) {
+				for (last = first + 1; last < queries.size() && dicts[last] == dicts[first]; ++last) {
+				}
+				bool stable = !dicts[first]->is_compressed();
+				dicts[first]->get_many(span<const string_view>(queries).subspan(first, last - first),
+						[&](size_t i, string_view candidate, size_t) {
+							add(pending[first + i], candidate, stable);
+						}, [&](size_t i) {
+							missing(pending[first + i]);
+						}, options.offset, options.limit);
+				if (options.timed) {
+					looked_up(ticks());
+				}
+			}
+		}
+
+		uint64_t write_start = options.timed ? ticks() : 0;
+		if (options.binary) {
+			if (!binary.write(n)) {
+				cerr << "nie udalo sie zapisac wyniku\n";
+				return 6;
+			}
+		} else {
+			for (size_t i = 0; i < n; ++i) {
+				if (cached[i]) {
+					cout << *cached[i];
+					cached[i].reset();
+				} else {
+					results[i] += '\n';
+					cout << results[i];
+					if (cache) {
+						cache->insert(lines[i], results[i]);
+					}
+				}
+			}
+		}
+
+		if (options.timed) {
+			//a lookup lasts from the end of the one before it, the queries of a batch
+			//being looked up one after another
+			uint64_t written = ticks();
+			uint64_t previous = lookup_start;
+			for (size_t i = 0; i < n; ++i) {
+				const line_times& t = times[i];
+				query_timer::record(query_timer::parse, t.parsed - t.read);
+				if (t.looked_up) {
+					query_timer::record(query_timer::lookup, t.looked_up - previous);
+					previous = t.looked_up;
+				}
+				query_timer::record(query_timer::write, written - write_start);
+				//the lines read after this one were waited for meanwhile
+				query_timer::record(query_timer::cycle, written - t.read - (waited - t.waited));
+			}
+		}
+	}
+	return error;
+}
+
+int main(int argc, char* argv[]) {
+	query_options options;
+	bool compress = false;
+	bool stats = false;
+	size_t cache_size = 0;
+	bool encode = false;
+	bool distinct = false;
+	bool counts = false;
+	bool frequencies = false;
+	size_t memory_limit = 0;
+	size_t page_size = 0;
+	bool generate = false;
+	vector<pair<string, string>> sources; //name and path of every dictionary
+	vector<pair<string, string>> deltas; //name of a dictionary and path of changes to it
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-c") == 0) {
+			compress = true;
+		} else if (strcmp(argv[i], "-e") == 0) {
+			encode = true;
+		} else if (strcmp(argv[i], "-u") == 0) {
+			distinct = true;
+		} else if (strcmp(argv[i], "-n") == 0) {
+			distinct = counts = true;
+		} else if (strcmp(argv[i], "-f") == 0) {
+			frequencies = true;
+		} else if (strcmp(argv[i], "-t") == 0) {
+			options.multitap = true;
+		} else if (strcmp(argv[i], "-v") == 0) {
+			options.multitap = options.validate = true;
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			//-l limit
+			options.limit = strtoull(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			//-o offset
+			options.offset = strtoull(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "-g") == 0) {
+			generate = compress = true;
+		} else if (strcmp(argv[i], "-s") == 0) {
+			options.timed = true;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			options.binary = true;
+		} else if (strcmp(argv[i], "-m") == 0) {
+			stats = true;
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && strchr(argv[i + 1], '=')) {
+			//-d name=path
+			const char* source = argv[++i];
+			const char* eq = strchr(source, '=');
+			sources.emplace_back(string(source, eq), string(eq + 1));
+		} else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+			//-x bytes
+			memory_limit = strtoull(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc
+				&& (strcmp(argv[i + 1], "2M") == 0 || strcmp(argv[i + 1], "1G") == 0)) {
+			//-p 2M or -p 1G
+			page_size = argv[++i][0] == '2' ? 2 << 20 : 1 << 30;
+			compress = true;
+		} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			//-a path or -a name=path
+			const char* delta = argv[++i];
+			const char* eq = strchr(delta, '=');
+			if (eq) {
+				deltas.emplace_back(string(delta, eq), string(eq + 1));
+			} else {
+				deltas.emplace_back("", delta);
+			}
+		} else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			//-k bytes
+			cache_size = strtoull(argv[++i], nullptr, 10);
+		} else {
+			cerr << "nieznana opcja " << argv[i] << "\n";
+			return 4;
+		}
+	}
+
+	//converting words into digits does not need a dictionary file
+	if (encode) {
+		return encode_stream(T9_dictionary(), distinct, counts);
+	}
+
+	//without -d there is a single dictionary and queries are not prefixed with its name
+	options.named = !sources.empty();
+	T9_registry registry(sources.size() > 1);
+#ifdef T9_EMBEDDED
+	//the compiled in dictionary replaces slownik.txt
+	if (!options.named) {
+		registry.add("", t9_embedded);
+	}
+#else
+	if (!options.named) {
+		sources.emplace_back("", "slownik.txt");
+	}
+#endif
+
+	for (const auto& source : sources) {
+		T9_dictionary& dict = registry.add(source.first);
+		if (page_size) {
+			dict.use_huge_pages(page_size);
+		}
+		int error = memory_limit ?
+				load_external(dict, source.second, memory_limit) : load(dict, source.second, frequencies);
+		if (error) {
+			return error;
+		}
+		if (compress) {
+			dict.compress();
+		}
+	}
+
+	for (const auto& delta : deltas) {
+		T9_dictionary* dict = registry.find(delta.first);
+		if (!dict) {
+			cerr << "nieznany slownik " << delta.first << "\n";
+			return 4;
+		}
+		int error = apply_delta(*dict, delta.second);
+		if (error) {
+			return error;
+		}
+	}
+
+	if (generate) {
+		registry.find(options.named ? sources.front().first : "")->write_embedded(cout);
+		return 0;
+	}
+
+	if (stats) {
+		for (const auto& p : registry.all()) {
+			cerr << "slownik " << p.first << ": " << p.second.memory_usage() << " B\n";
+		}
+		cerr << "wspolne slowa: " << registry.shared_memory_usage() << " B\n";
+	}
+
+	unique_ptr<query_cache> cache;
+	if (cache_size) {
+		cache.reset(new query_cache(cache_size));
+	}
+
+	if (options.timed) {
+		ticks_per_nanosecond();
+		//SIGUSR1 is taken by a thread of its own, so the timings are printed even while
+		//queries wait for input; it is blocked before any other thread could receive it
+		sigset_t usr1;
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+		thread([usr1] {
+			int signal;
+			while (sigwait(&usr1, &signal) == 0) {
+				query_timer::print(cerr);
+			}
+		}).detach();
+		//only this thread reads stdin and writes stdout, so their locks, taken on every
+		//character once a second thread exists, are not needed
+		__fsetlocking(stdin, FSETLOCKING_BYCALLER);
+		__fsetlocking(stdout, FSETLOCKING_BYCALLER);
+	}
+
+	int error = answer_queries(registry, options, cache.get());
+
+	if (options.timed) {
+		query_timer::print(cerr);
+	}
+
+	if (stats && cache) {
+		cerr << "pamiec podreczna: " << cache->hit_count() << " trafien, " << cache->miss_count() << " chybien\n";
+	}
+	return error;
 }
@@ -5,29 +5,1204 @@
 
 #include "polynomial.hpp"
 
-polynomial& polynomial::operator+=(const polynomial& rhs) {
-	for (auto p : rhs.data) {
-		auto it = data.emplace(p.first, 0).first;
-		it->second += p.second;
-		it->second %= MOD;
-		if (it->second == 0) {
-			data.erase(it);
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define POLYNOMIAL_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using coefficient_vector = std::vector<polynomial::uint_type>;
+using thresholds_type = polynomial::multiplication_thresholds;
+
+//NTT friendly primes p = k * 2^n + 1, all with 3 as a primitive root
+//their product exceeds the largest possible coefficient of a product of two
+//polynomials with at most 2^23 terms, so CRT recovers it exactly
+constexpr uint32_t ntt_primes[] = { 998244353, 167772161, 469762049 };
+const size_t ntt_max_size = size_t(1) << 23;
+
+//arithmetic modulo polynomial::MOD on residues in [0, MOD)
+//products are reduced with Barrett's method instead of a hardware division
+
+const uint64_t mod = polynomial::MOD;
+const uint64_t barrett_factor = ~uint64_t(0) / mod; //floor(2^64 / MOD)
+const uint64_t wide_factor = (~uint64_t(0) % mod + 1) % mod; //2^64 mod MOD
+
+//high 64 bits of a 128 bit product
+uint64_t multiply_high(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+	return (unsigned __int128) a * b >> 64;
+#else
+	uint64_t a_lo = uint32_t(a), a_hi = a >> 32;
+	uint64_t b_lo = uint32_t(b), b_hi = b >> 32;
+	uint64_t mid = (a_lo * b_lo >> 32) + uint32_t(a_hi * b_lo) + a_lo * b_hi;
+	return a_hi * b_hi + (a_hi * b_lo >> 32) + (mid >> 32);
+#endif
+}
+
+//the quotient estimate is at most one too small, so one correction suffices
+polynomial::uint_type reduce(uint64_t x) {
+	uint64_t r = x - multiply_high(x, barrett_factor) * mod;
+	return r >= mod ? r - mod : r;
+}
+
+//reduces hi * 2^64 + lo
+polynomial::uint_type reduce(uint64_t hi, uint64_t lo) {
+	return reduce(reduce(hi) * wide_factor + reduce(lo));
+}
+
+polynomial::uint_type add_mod(polynomial::uint_type a, polynomial::uint_type b) {
+	polynomial::uint_type sum = a + b;
+	return sum >= mod ? sum - mod : sum;
+}
+
+polynomial::uint_type sub_mod(polynomial::uint_type a, polynomial::uint_type b) {
+	return a >= b ? a - b : a + mod - b;
+}
+
+polynomial::uint_type mul_mod(uint64_t a, uint64_t b) {
+	return reduce(a * b);
+}
+
+//kernels on contiguous residues, dst and src may be the same array
+//scaling uses Shoup's method: with factor' = floor(factor * 2^32 / MOD) the quotient
+//estimate (x * factor') >> 32 is at most one too small, so only low halves are needed
+
+static_assert(sizeof(polynomial::uint_type) == 4,
+		"vector kernels assume 32 bit coefficients");
+
+using coefficient_type = polynomial::uint_type;
+
+uint32_t shoup_factor(coefficient_type factor) {
+	return (uint64_t(factor) << 32) / mod;
+}
+
+//pointwise products use Montgomery's reduction: one operand is kept multiplied by 2^32
+//and t * 2^-32 mod MOD is computed from the low halves with -MOD^-1 mod 2^32
+//each Newton step doubles the number of correct low bits, MOD * MOD = 1 mod 8
+constexpr uint32_t inverse_mod_2_32(uint32_t inverse, int steps) {
+	return steps == 0 ? inverse : inverse_mod_2_32(inverse * (2 - uint32_t(mod) * inverse), steps - 1);
+}
+
+constexpr uint32_t montgomery_factor = -inverse_mod_2_32(mod, 4);
+
+coefficient_type to_montgomery(coefficient_type x) {
+	return reduce(uint64_t(x) << 32);
+}
+
+//t must be below MOD * 2^32
+coefficient_type montgomery_reduce(uint64_t t) {
+	uint32_t m = uint32_t(t) * montgomery_factor;
+	uint32_t u = (t + uint64_t(m) * mod) >> 32;
+	return u >= mod ? u - mod : u;
+}
+
+void add_scalar(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		dst[i] = add_mod(dst[i], src[i]);
+	}
+}
+
+void sub_scalar(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		dst[i] = sub_mod(dst[i], src[i]);
+	}
+}
+
+void scale_scalar(coefficient_type* dst, const coefficient_type* src,
+		coefficient_type factor, size_t n) {
+	uint32_t factor_shoup = shoup_factor(factor);
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t q = uint64_t(src[i]) * factor_shoup >> 32;
+		uint32_t r = src[i] * factor - q * uint32_t(mod);
+		dst[i] = r >= mod ? r - mod : r;
+	}
+}
+
+//acc[i] = acc[i] * factors[i] + addend, factors in Montgomery form
+void multiply_add_scalar(coefficient_type* acc, const coefficient_type* factors,
+		coefficient_type addend, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		acc[i] = add_mod(montgomery_reduce(uint64_t(acc[i]) * factors[i]), addend);
+	}
+}
+
+#ifdef POLYNOMIAL_X86_KERNELS
+
+//residues are below 2^30, so sums never wrap and min(x, x - MOD) is x mod MOD
+
+__attribute__((target("avx2")))
+void add_avx2(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	const __m256i m = _mm256_set1_epi32(mod);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i sum = _mm256_add_epi32(a, b);
+		sum = _mm256_min_epu32(sum, _mm256_sub_epi32(sum, m));
+		_mm256_storeu_si256((__m256i*) (dst + i), sum);
+	}
+	add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void sub_avx2(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	const __m256i m = _mm256_set1_epi32(mod);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i diff = _mm256_sub_epi32(a, b);
+		diff = _mm256_min_epu32(diff, _mm256_add_epi32(diff, m));
+		_mm256_storeu_si256((__m256i*) (dst + i), diff);
+	}
+	sub_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void scale_avx2(coefficient_type* dst, const coefficient_type* src,
+		coefficient_type factor, size_t n) {
+	const __m256i m = _mm256_set1_epi32(mod);
+	const __m256i f = _mm256_set1_epi32(factor);
+	const __m256i f_shoup = _mm256_set1_epi32(shoup_factor(factor));
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (src + i));
+		//high halves of the 32x32 bit products, even and odd lanes separately
+		__m256i q_even = _mm256_srli_epi64(_mm256_mul_epu32(x, f_shoup), 32);
+		__m256i q_odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), f_shoup);
+		__m256i q = _mm256_blend_epi32(q_even, q_odd, 0xAA);
+		__m256i r = _mm256_sub_epi32(_mm256_mullo_epi32(x, f),
+				_mm256_mullo_epi32(q, m));
+		r = _mm256_min_epu32(r, _mm256_sub_epi32(r, m));
+		_mm256_storeu_si256((__m256i*) (dst + i), r);
+	}
+	scale_scalar(dst + i, src + i, factor, n - i);
+}
+
+__attribute__((target("avx2")))
+__m256i montgomery_reduce_avx2(__m256i t, __m256i factor, __m256i m) {
+	__m256i q = _mm256_mul_epu32(t, factor);
+	return _mm256_srli_epi64(_mm256_add_epi64(t, _mm256_mul_epu32(q, m)), 32);
+}
+
+__attribute__((target("avx2")))
+void multiply_add_avx2(coefficient_type* acc, const coefficient_type* factors,
+		coefficient_type addend, size_t n) {
+	const __m256i m = _mm256_set1_epi32(mod);
+	const __m256i factor = _mm256_set1_epi32(montgomery_factor);
+	const __m256i c = _mm256_set1_epi32(addend);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (acc + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (factors + i));
+		__m256i even = montgomery_reduce_avx2(_mm256_mul_epu32(a, b), factor, m);
+		__m256i odd = montgomery_reduce_avx2(
+				_mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)),
+				factor, m);
+		__m256i r = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+		r = _mm256_min_epu32(r, _mm256_sub_epi32(r, m));
+		r = _mm256_add_epi32(r, c);
+		r = _mm256_min_epu32(r, _mm256_sub_epi32(r, m));
+		_mm256_storeu_si256((__m256i*) (acc + i), r);
+	}
+	multiply_add_scalar(acc + i, factors + i, addend, n - i);
+}
+
+//GCC 12 reports the undefined upper lanes that _mm512_mul_epu32 and
+//_mm512_mask_blend_epi32 start from as maybe uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+void add_avx512(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	const __m512i m = _mm512_set1_epi32(mod);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i a = _mm512_loadu_si512(dst + i);
+		__m512i b = _mm512_loadu_si512(src + i);
+		__m512i sum = _mm512_add_epi32(a, b);
+		sum = _mm512_min_epu32(sum, _mm512_sub_epi32(sum, m));
+		_mm512_storeu_si512(dst + i, sum);
+	}
+	add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void sub_avx512(coefficient_type* dst, const coefficient_type* src, size_t n) {
+	const __m512i m = _mm512_set1_epi32(mod);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i a = _mm512_loadu_si512(dst + i);
+		__m512i b = _mm512_loadu_si512(src + i);
+		__m512i diff = _mm512_sub_epi32(a, b);
+		diff = _mm512_min_epu32(diff, _mm512_add_epi32(diff, m));
+		_mm512_storeu_si512(dst + i, diff);
+	}
+	sub_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void scale_avx512(coefficient_type* dst, const coefficient_type* src,
+		coefficient_type factor, size_t n) {
+	const __m512i m = _mm512_set1_epi32(mod);
+	const __m512i f = _mm512_set1_epi32(factor);
+	const __m512i f_shoup = _mm512_set1_epi32(shoup_factor(factor));
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i x = _mm512_loadu_si512(src + i);
+		__m512i q_even = _mm512_srli_epi64(_mm512_mul_epu32(x, f_shoup), 32);
+		__m512i q_odd = _mm512_mul_epu32(_mm512_srli_epi64(x, 32), f_shoup);
+		__m512i q = _mm512_mask_blend_epi32(0xAAAA, q_even, q_odd);
+		__m512i r = _mm512_sub_epi32(_mm512_mullo_epi32(x, f),
+				_mm512_mullo_epi32(q, m));
+		r = _mm512_min_epu32(r, _mm512_sub_epi32(r, m));
+		_mm512_storeu_si512(dst + i, r);
+	}
+	scale_scalar(dst + i, src + i, factor, n - i);
+}
+
+__attribute__((target("avx512f")))
+__m512i montgomery_reduce_avx512(__m512i t, __m512i factor, __m512i m) {
+	__m512i q = _mm512_mul_epu32(t, factor);
+	return _mm512_srli_epi64(_mm512_add_epi64(t, _mm512_mul_epu32(q, m)), 32);
+}
+
+__attribute__((target("avx512f")))
+void multiply_add_avx512(coefficient_type* acc, const coefficient_type* factors,
+		coefficient_type addend, size_t n) {
+	const __m512i m = _mm512_set1_epi32(mod);
+	const __m512i factor = _mm512_set1_epi32(montgomery_factor);
+	const __m512i c = _mm512_set1_epi32(addend);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i a = _mm512_loadu_si512(acc + i);
+		__m512i b = _mm512_loadu_si512(factors + i);
+		__m512i even = montgomery_reduce_avx512(_mm512_mul_epu32(a, b), factor, m);
+		__m512i odd = montgomery_reduce_avx512(
+				_mm512_mul_epu32(_mm512_srli_epi64(a, 32), _mm512_srli_epi64(b, 32)),
+				factor, m);
+		__m512i r = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+		r = _mm512_min_epu32(r, _mm512_sub_epi32(r, m));
+		r = _mm512_add_epi32(r, c);
+		r = _mm512_min_epu32(r, _mm512_sub_epi32(r, m));
+		_mm512_storeu_si512(acc + i, r);
+	}
+	multiply_add_scalar(acc + i, factors + i, addend, n - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+//picked once for the CPU the program runs on
+struct vector_kernels {
+	void (*add)(coefficient_type* dst, const coefficient_type* src, size_t n);
+	void (*sub)(coefficient_type* dst, const coefficient_type* src, size_t n);
+	void (*scale)(coefficient_type* dst, const coefficient_type* src,
+			coefficient_type factor, size_t n);
+	void (*multiply_add)(coefficient_type* acc, const coefficient_type* factors,
+			coefficient_type addend, size_t n);
+};
+
+vector_kernels select_kernels() {
+#ifdef POLYNOMIAL_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return {add_avx512, sub_avx512, scale_avx512, multiply_add_avx512};
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return {add_avx2, sub_avx2, scale_avx2, multiply_add_avx2};
+	}
+#endif
+	return {add_scalar, sub_scalar, scale_scalar, multiply_add_scalar};
+}
+
+//a function-local static, so arithmetic during static initialization of other
+//translation units does not see null pointers
+const vector_kernels& kernels() {
+	static const vector_kernels instance = select_kernels();
+	return instance;
+}
+
+//polynomial::threads, with 0 meaning the number of hardware threads
+unsigned thread_count() {
+	static const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+	return polynomial::threads ? polynomial::threads : hardware;
+}
+
+//fork-join pool shared by all multiplications
+//idle workers take the oldest queued task, a thread waiting for its own tasks runs the
+//newest ones meanwhile, so tasks may start nested runs without blocking the pool
+class thread_pool {
+public:
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	//runs task(0), ..., task(count - 1) and returns when all of them are done
+	//if tasks throw, the first exception is rethrown once none of them refers to this call
+	void run(size_t count, const std::function<void(size_t)>& task) {
+		unsigned threads = thread_count();
+		if (threads <= 1 || count <= 1) {
+			for (size_t i = 0; i < count; ++i) {
+				task(i);
+			}
+			return;
+		}
+
+		size_t remaining = 0;
+		std::exception_ptr error; //guarded by mutex
+		bool queued = true;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			while (workers.size() + 1 < threads) {
+				workers.emplace_back(&thread_pool::work, this, workers.size());
+			}
+			try {
+				for (size_t i = 1; i < count; ++i) {
+					queue.push_back([this, &task, &remaining, &error, i] {
+						std::exception_ptr failure;
+						try {
+							task(i);
+						} catch (...) {
+							failure = std::current_exception();
+						}
+						std::lock_guard<std::mutex> lock(mutex);
+						if (failure && !error) {
+							error = failure;
+						}
+						if (--remaining == 0) {
+							changed.notify_all();
+						}
+					});
+					++remaining;
+				}
+			} catch (...) {
+				error = std::current_exception();
+				queued = false;
+			}
+		}
+		changed.notify_all();
+
+		std::exception_ptr failure;
+		try {
+			if (queued) {
+				task(0);
+			}
+		} catch (...) {
+			failure = std::current_exception();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		if (failure && !error) {
+			error = failure;
+		}
+		while (remaining != 0) {
+			if (queue.empty()) {
+				changed.wait(lock);
+				continue;
+			}
+			auto job = std::move(queue.back());
+			queue.pop_back();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::function<void()>> queue;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	void work(size_t id) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [&] {
+				return stopping || (!queue.empty() && id + 1 < thread_count());
+			});
+			if (stopping) {
+				return;
+			}
+			auto job = std::move(queue.front());
+			queue.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+};
+
+thread_pool& pool() {
+	static thread_pool instance;
+	return instance;
+}
+
+//loops over fewer elements run on the calling thread
+const size_t parallel_grain = 1 << 13;
+
+//calls body(first, last) for consecutive chunks of [0, n), in parallel when n allows
+//chunks of at least grain elements
+template<typename function>
+void parallel_chunks(size_t n, size_t grain, function body) {
+	size_t count = std::min<size_t>(n / std::max<size_t>(grain, 1),
+			4 * size_t(thread_count()));
+	if (count <= 1) {
+		body(0, n);
+		return;
+	}
+	size_t chunk = (n + count - 1) / count;
+	pool().run(count, [&](size_t i) {
+		body(std::min(n, i * chunk), std::min(n, (i + 1) * chunk));
+	});
+}
+
+uint64_t power(uint64_t base, uint64_t exponent, uint64_t mod) {
+	uint64_t result = 1;
+	for (base %= mod; exponent > 0; exponent >>= 1) {
+		if (exponent & 1) {
+			result = result * base % mod;
+		}
+		base = base * base % mod;
+	}
+	return result;
+}
+
+size_t reverse_bits(size_t x, size_t bits) {
+	size_t result = 0;
+	for (size_t i = 0; i < bits; ++i, x >>= 1) {
+		result = result << 1 | (x & 1);
+	}
+	return result;
+}
+
+//in-place number theoretic transform, a.size() must be a power of 2
+//every level is split into chunks of butterflies for the thread pool
+//the prime is a template argument so that reductions modulo it compile to multiplications
+template<uint32_t prime>
+void ntt(std::vector<uint32_t>& a, bool invert) {
+	size_t n = a.size();
+	size_t bits = 0;
+	while (size_t(1) << bits < n) {
+		++bits;
+	}
+	parallel_chunks(n, parallel_grain, [&](size_t first, size_t last) {
+		//j is i with its bits reversed, incremented from the top bit down
+		size_t j = reverse_bits(first, bits);
+		for (size_t i = first; i < last; ++i) {
+			if (i < j) {
+				std::swap(a[i], a[j]);
+			}
+			size_t bit = n >> 1;
+			for (; j & bit; bit >>= 1) {
+				j ^= bit;
+			}
+			j ^= bit;
+		}
+	});
+
+	std::vector<uint32_t> roots(n / 2);
+	for (size_t len = 2; len <= n; len <<= 1) {
+		size_t half = len / 2;
+		uint64_t root = power(3, (prime - 1) / len, prime);
+		if (invert) {
+			root = power(root, prime - 2, prime);
+		}
+		parallel_chunks(half, parallel_grain, [&](size_t first, size_t last) {
+			uint64_t r = power(root, first, prime);
+			for (size_t j = first; j < last; ++j) {
+				roots[j] = r;
+				r = r * root % prime;
+			}
+		});
+
+		uint32_t* data = a.data();
+		const uint32_t* w = roots.data();
+		parallel_chunks(n / 2, parallel_grain, [=](size_t first, size_t last) {
+			for (size_t t = first; t < last; ++t) {
+				size_t j = t & (half - 1);
+				size_t i = (t - j) * 2 + j;
+				uint32_t u = data[i];
+				uint32_t v = uint64_t(data[i + half]) * w[j] % prime;
+				data[i] = u + v < prime ? u + v : u + v - prime;
+				data[i + half] = u >= v ? u - v : u + prime - v;
+			}
+		});
+	}
+
+	if (invert) {
+		uint64_t scale = power(n, prime - 2, prime);
+		parallel_chunks(n, parallel_grain, [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; ++i) {
+				a[i] = a[i] * scale % prime;
+			}
+		});
+	}
+}
+
+//cyclic convolution of length n modulo prime
+template<uint32_t prime>
+std::vector<uint32_t> ntt_convolve(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, size_t n) {
+	auto transform = [n](const coefficient_vector& v) {
+		std::vector<uint32_t> result(n, 0);
+		parallel_chunks(v.size(), parallel_grain, [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; ++i) {
+				result[i] = v[i] % prime;
+			}
+		});
+		ntt<prime>(result, false);
+		return result;
+	};
+
+	std::vector<uint32_t> a, b;
+	if (&lhs == &rhs) {
+		a = transform(lhs);
+		b = a;
+	} else {
+		pool().run(2, [&](size_t i) {
+			(i == 0 ? a : b) = transform(i == 0 ? lhs : rhs);
+		});
+	}
+
+	parallel_chunks(n, parallel_grain, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			a[i] = uint64_t(a[i]) * b[i] % prime;
+		}
+	});
+	ntt<prime>(a, true);
+	return a;
+}
+
+coefficient_vector multiply_ntt(const coefficient_vector& lhs,
+		const coefficient_vector& rhs) {
+	size_t size = lhs.size() + rhs.size() - 1;
+	size_t n = 1;
+	while (n < size) {
+		n <<= 1;
+	}
+
+	std::vector<uint32_t> residues[3];
+	pool().run(3, [&](size_t i) {
+		if (i == 0) {
+			residues[0] = ntt_convolve<ntt_primes[0]>(lhs, rhs, n);
+		} else if (i == 1) {
+			residues[1] = ntt_convolve<ntt_primes[1]>(lhs, rhs, n);
+		} else {
+			residues[2] = ntt_convolve<ntt_primes[2]>(lhs, rhs, n);
+		}
+	});
+
+	//Garner's algorithm: x = x0 + x1 * p0 + x2 * p0 * p1
+	const uint64_t p0 = ntt_primes[0], p1 = ntt_primes[1], p2 = ntt_primes[2];
+	const uint64_t p0_inv = power(p0, p1 - 2, p1);
+	const uint64_t p01_inv = power(p0 * p1 % p2, p2 - 2, p2);
+	const uint64_t p01 = mul_mod(p0, p1);
+
+	coefficient_vector result(size);
+	parallel_chunks(size, parallel_grain, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			uint64_t x0 = residues[0][i];
+			uint64_t x1 = (residues[1][i] + p1 - x0 % p1) * p0_inv % p1;
+			uint64_t x01 = (x0 + x1 * p0) % p2;
+			uint64_t x2 = (residues[2][i] + p2 - x01) * p01_inv % p2;
+			result[i] = reduce(x0 + x1 * p0 + reduce(x2) * p01);
+		}
+	});
+	return result;
+}
+
+//every coefficient of the result is summed exactly in 128 bits and reduced once
+//result += lhs * rhs, result must hold at least lhs.size() + rhs.size() - 1 coefficients
+//large products are split into blocks of output coefficients for the thread pool
+void multiply_add_schoolbook(coefficient_vector& result, const coefficient_vector& lhs,
+		const coefficient_vector& rhs) {
+	size_t shorter = std::min(lhs.size(), rhs.size());
+	size_t grain = std::max<size_t>(64, parallel_grain * 8 / shorter);
+	parallel_chunks(lhs.size() + rhs.size() - 1, grain, [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; ++k) {
+			size_t first = k >= rhs.size() ? k - rhs.size() + 1 : 0;
+			size_t last = std::min(k + 1, lhs.size());
+			uint64_t hi = 0, lo = result[k];
+			for (size_t i = first; i < last; ++i) {
+				uint64_t tmp = uint64_t(lhs[i]) * rhs[k - i];
+				lo += tmp;
+				hi += lo < tmp;
+			}
+			result[k] = reduce(hi, lo);
+		}
+	});
+}
+
+coefficient_vector multiply_schoolbook(const coefficient_vector& lhs,
+		const coefficient_vector& rhs) {
+	coefficient_vector result(lhs.size() + rhs.size() - 1, 0);
+	multiply_add_schoolbook(result, lhs, rhs);
+	return result;
+}
+
+//the splits of the faster methods need at least three terms in each operand
+bool use_schoolbook(size_t shorter, const thresholds_type& thresholds) {
+	return shorter < std::max<size_t>(thresholds.karatsuba, 3);
+}
+
+coefficient_vector multiply(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, const thresholds_type& thresholds);
+
+//products with a shorter operand at least this long compute their subproducts in parallel
+const size_t parallel_split_threshold = 256;
+
+//results[i] = lhs[i] * rhs[i]
+std::vector<coefficient_vector> multiply_all(const std::vector<coefficient_vector>& lhs,
+		const std::vector<coefficient_vector>& rhs, const thresholds_type& thresholds,
+		bool parallel) {
+	std::vector<coefficient_vector> results(lhs.size());
+	auto task = [&](size_t i) {
+		results[i] = multiply(lhs[i], rhs[i], thresholds);
+	};
+	if (parallel) {
+		pool().run(lhs.size(), task);
+	} else {
+		for (size_t i = 0; i < lhs.size(); ++i) {
+			task(i);
+		}
+	}
+	return results;
+}
+
+coefficient_vector slice(const coefficient_vector& v, size_t first, size_t last) {
+	return coefficient_vector(v.begin() + first, v.begin() + last);
+}
+
+//result[offset + i] += v[i], terms past the end of result must be zero
+void add_shifted(coefficient_vector& result, const coefficient_vector& v,
+		size_t offset) {
+	size_t n = std::min(v.size(), result.size() - std::min(offset, result.size()));
+	kernels().add(result.data() + offset, v.data(), n);
+}
+
+//returns a * x + b * y for coefficients a, b, the shorter vector is padded with zeros
+coefficient_vector combine(const coefficient_vector& x, coefficient_type a,
+		const coefficient_vector& y, coefficient_type b) {
+	coefficient_vector result(std::max(x.size(), y.size()), 0);
+	kernels().scale(result.data(), x.data(), a, x.size());
+	if (b == 1) {
+		kernels().add(result.data(), y.data(), y.size());
+	} else if (b == mod - 1) {
+		kernels().sub(result.data(), y.data(), y.size());
+	} else {
+		coefficient_vector tmp(y.size());
+		kernels().scale(tmp.data(), y.data(), b, y.size());
+		kernels().add(result.data(), tmp.data(), tmp.size());
+	}
+	return result;
+}
+
+//operands split as lhs = a0 + a1 x^m, rhs = b0 + b1 x^m
+//lhs * rhs = a0 b0 + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) x^m + a1 b1 x^2m
+coefficient_vector multiply_karatsuba(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, const thresholds_type& thresholds) {
+	size_t m = (std::min(lhs.size(), rhs.size()) + 1) / 2;
+	auto a0 = slice(lhs, 0, m), a1 = slice(lhs, m, lhs.size());
+	auto b0 = slice(rhs, 0, m), b1 = slice(rhs, m, rhs.size());
+
+	auto z = multiply_all({ a0, a1, combine(a0, 1, a1, 1) },
+			{ b0, b1, combine(b0, 1, b1, 1) }, thresholds, m >= parallel_split_threshold / 2);
+	auto& z0 = z[0];
+	auto& z2 = z[1];
+	auto z1 = combine(z[2], 1, combine(z0, 1, z2, 1), polynomial::MOD - 1);
+
+	coefficient_vector result(lhs.size() + rhs.size() - 1, 0);
+	add_shifted(result, z0, 0);
+	add_shifted(result, z1, m);
+	add_shifted(result, z2, 2 * m);
+	return result;
+}
+
+//operands split into three parts at multiples of k, products evaluated at 0, 1, -1, -2
+//and infinity and interpolated with Bodrato's sequence
+coefficient_vector multiply_toom3(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, const thresholds_type& thresholds) {
+	const uint64_t inv2 = power(2, mod - 2, mod), inv3 = power(3, mod - 2, mod);
+
+	size_t k = std::min(lhs.size(), rhs.size()) / 3;
+	auto evaluate = [&](const coefficient_vector& v) {
+		auto p0 = slice(v, 0, k), p1 = slice(v, k, 2 * k), p2 = slice(v, 2 * k, v.size());
+		auto even = combine(p0, 1, p2, 1);
+		std::vector<coefficient_vector> values;
+		values.push_back(p0);
+		values.push_back(combine(even, 1, p1, 1));
+		values.push_back(combine(even, 1, p1, mod - 1));
+		values.push_back(combine(combine(p0, 1, p2, 4), 1, p1, mod - 2));
+		values.push_back(p2);
+		return values;
+	};
+	auto a = evaluate(lhs), b = evaluate(rhs);
+
+	auto r = multiply_all(a, b, thresholds, 3 * k >= parallel_split_threshold);
+
+	//r = { r(0), r(1), r(-1), r(-2), r(inf) } becomes the coefficients of x^ik
+	auto c3 = combine(r[3], inv3, r[1], mod - inv3);
+	auto c1 = combine(r[1], inv2, r[2], mod - inv2);
+	auto c2 = combine(r[2], 1, r[0], mod - 1);
+	c3 = combine(combine(c2, inv2, c3, mod - inv2), 1, r[4], 2);
+	c2 = combine(combine(c2, 1, c1, 1), 1, r[4], mod - 1);
+	c1 = combine(c1, 1, c3, mod - 1);
+
+	coefficient_vector result(lhs.size() + rhs.size() - 1, 0);
+	add_shifted(result, r[0], 0);
+	add_shifted(result, c1, k);
+	add_shifted(result, c2, 2 * k);
+	add_shifted(result, c3, 3 * k);
+	add_shifted(result, r[4], 4 * k);
+	return result;
+}
+
+//cuts the longer operand into pieces as long as the shorter one
+coefficient_vector multiply_unbalanced(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, const thresholds_type& thresholds) {
+	const auto& longer = lhs.size() >= rhs.size() ? lhs : rhs;
+	const auto& shorter = lhs.size() >= rhs.size() ? rhs : lhs;
+
+	std::vector<coefficient_vector> pieces;
+	for (size_t i = 0; i < longer.size(); i += shorter.size()) {
+		pieces.push_back(slice(longer, i, std::min(i + shorter.size(), longer.size())));
+	}
+	auto products = multiply_all(pieces,
+			std::vector<coefficient_vector>(pieces.size(), shorter), thresholds,
+			shorter.size() >= parallel_split_threshold);
+
+	//summed in order, so the result does not depend on the scheduling
+	coefficient_vector result(lhs.size() + rhs.size() - 1, 0);
+	for (size_t i = 0; i < products.size(); ++i) {
+		add_shifted(result, products[i], i * shorter.size());
+	}
+	return result;
+}
+
+//both operands must be nonempty
+coefficient_vector multiply(const coefficient_vector& lhs,
+		const coefficient_vector& rhs, const thresholds_type& thresholds) {
+	size_t shorter = std::min(lhs.size(), rhs.size());
+	size_t longer = std::max(lhs.size(), rhs.size());
+
+	if (use_schoolbook(shorter, thresholds)) {
+		return multiply_schoolbook(lhs, rhs);
+	}
+	if (shorter >= thresholds.ntt && lhs.size() + rhs.size() - 1 <= ntt_max_size) {
+		return multiply_ntt(lhs, rhs);
+	}
+	if (longer > 2 * shorter) {
+		return multiply_unbalanced(lhs, rhs, thresholds);
+	}
+	if (shorter >= thresholds.toom3) {
+		return multiply_toom3(lhs, rhs, thresholds);
+	}
+	return multiply_karatsuba(lhs, rhs, thresholds);
+}
+
+//divisions with both the quotient and the divisor at least this long use Newton's method
+const size_t newton_division_threshold = 16384;
+
+//first n coefficients of the power series 1 / f, f[0] must be nonzero
+//each Newton step g = g (2 - f g) doubles the number of correct coefficients
+coefficient_vector inverse_series(const coefficient_vector& f, size_t n) {
+	coefficient_vector g = { static_cast<coefficient_type>(power(f[0], mod - 2, mod)) };
+	for (size_t k = 1; k < n;) {
+		k = std::min(2 * k, n);
+		auto fg = multiply(slice(f, 0, std::min(k, f.size())), g, polynomial::thresholds);
+		fg.resize(k, 0);
+		kernels().scale(fg.data(), fg.data(), mod - 1, k);
+		fg[0] = add_mod(fg[0], 2);
+		g = multiply(g, fg, polynomial::thresholds);
+		g.resize(k);
+	}
+	return g;
+}
+
+//quotient and remainder of dense operands, divident.size() >= divisor.size()
+std::pair<coefficient_vector, coefficient_vector> divide_schoolbook(
+		coefficient_vector remainder, const coefficient_vector& divisor) {
+	size_t m = divisor.size();
+	coefficient_type inverse = power(divisor.back(), mod - 2, mod);
+	coefficient_vector quotient(remainder.size() - m + 1), tmp(m);
+	for (size_t i = quotient.size(); i-- > 0;) {
+		quotient[i] = mul_mod(remainder[i + m - 1], inverse);
+		kernels().scale(tmp.data(), divisor.data(), quotient[i], m);
+		kernels().sub(remainder.data() + i, tmp.data(), m);
+	}
+	remainder.resize(m - 1);
+	return {quotient, remainder};
+}
+
+//first n terms of the power series inverse of the divisor with its coefficients reversed
+coefficient_vector reversed_inverse(const coefficient_vector& divisor, size_t n) {
+	return inverse_series(coefficient_vector(divisor.rbegin(), divisor.rend()), n);
+}
+
+//the reversed quotient is the reversed divident times the inverse of the reversed
+//divisor modulo x^(n - m + 1), the remainder follows from divident - quotient * divisor
+//inverse must hold at least n - m + 1 terms of reversed_inverse(divisor)
+std::pair<coefficient_vector, coefficient_vector> divide_newton(
+		const coefficient_vector& divident, const coefficient_vector& divisor,
+		const coefficient_vector& inverse) {
+	size_t m = divisor.size();
+	size_t n = divident.size() - m + 1;
+	coefficient_vector reversed_divident(divident.rbegin(), divident.rbegin() + n);
+
+	auto quotient = multiply(reversed_divident, slice(inverse, 0, n),
+			polynomial::thresholds);
+	quotient.resize(n);
+	std::reverse(quotient.begin(), quotient.end());
+
+	//only the terms below x^(m - 1) are left
+	coefficient_vector remainder(divident.begin(), divident.begin() + m - 1);
+	if (m > 1) {
+		auto product = multiply(slice(quotient, 0, std::min(n, m - 1)),
+				slice(divisor, 0, m - 1), polynomial::thresholds);
+		kernels().sub(remainder.data(), product.data(), m - 1);
+	}
+	return {quotient, remainder};
+}
+
+//both operands must be nonempty
+std::pair<coefficient_vector, coefficient_vector> divide_dense(
+		const coefficient_vector& divident, const coefficient_vector& divisor) {
+	if (divident.size() < divisor.size()) {
+		return {coefficient_vector(), divident};
+	}
+	size_t n = divident.size() - divisor.size() + 1;
+	if (std::min(n, divisor.size()) >= newton_division_threshold) {
+		return divide_newton(divident, divisor, reversed_inverse(divisor, n));
+	}
+	return divide_schoolbook(divident, divisor);
+}
+
+//values of p at n points given in Montgomery form
+void evaluate_horner(const coefficient_vector& p, const coefficient_type* points,
+		coefficient_type* values, size_t n) {
+	std::fill(values, values + n, 0);
+	for (size_t i = p.size(); i-- > 0;) {
+		kernels().multiply_add(values, points, p[i], n);
+	}
+}
+
+//multipoint evaluation with more points and coefficients than this uses the subproduct tree
+const size_t multipoint_threshold = 65536;
+
+//ranges of at most this many points are handled directly
+const size_t subproduct_leaf_size = 256;
+
+
+//products of (x - points[i]) over ranges of points
+//node k covers [first, last) and has children 2k + 1 and 2k + 2
+class subproduct_tree {
+public:
+	explicit subproduct_tree(const coefficient_vector& points) :
+			points(points), nodes(8 * (points.size() / subproduct_leaf_size + 1)),
+			inverses(nodes.size()) {
+		for (auto x : points) {
+			montgomery_points.push_back(to_montgomery(x));
+		}
+		if (!points.empty()) {
+			build(0, 0, points.size());
 		}
 	}
-	validate_empty();
+
+	//the product of (x - points[i]) over all points
+	const coefficient_vector& root() const {
+		return nodes[0];
+	}
+
+	//values of p at every point, each is p modulo (x - points[i])
+	coefficient_vector evaluate(const coefficient_vector& p) const {
+		coefficient_vector values(points.size());
+		if (!points.empty()) {
+			evaluate(0, 0, points.size(), p, values);
+		}
+		return values;
+	}
+
+	//sum of weights[i] * root() / (x - points[i]) over all points
+	coefficient_vector combine(const coefficient_vector& weights) const {
+		if (points.empty()) {
+			return {};
+		}
+		return combine(0, 0, points.size(), weights);
+	}
+
+private:
+	coefficient_vector points;
+	coefficient_vector montgomery_points;
+	std::vector<coefficient_vector> nodes;
+	std::vector<coefficient_vector> inverses;
+
+	void build(size_t k, size_t first, size_t last) {
+		if (last - first <= subproduct_leaf_size) {
+			auto& node = nodes[k];
+			node = { 1 };
+			for (size_t i = first; i < last; ++i) {
+				//node *= x - points[i]
+				node.insert(node.begin(), 0);
+				for (size_t j = 0; j + 1 < node.size(); ++j) {
+					node[j] = sub_mod(node[j], mul_mod(node[j + 1], points[i]));
+				}
+			}
+			return;
+		}
+		size_t middle = first + (last - first) / 2;
+		build(2 * k + 1, first, middle);
+		build(2 * k + 2, middle, last);
+		nodes[k] = multiply(nodes[2 * k + 1], nodes[2 * k + 2], polynomial::thresholds);
+
+		//large children keep the inverse of their reversal for the way down
+		//the halves differ by at most one point, so the remainder of the parent
+		//divided by either child has a quotient no longer than the child
+		for (size_t child = 2 * k + 1; child <= 2 * k + 2; ++child) {
+			if (nodes[child].size() >= newton_division_threshold) {
+				inverses[child] = reversed_inverse(nodes[child], nodes[child].size());
+			}
+		}
+	}
+
+	coefficient_vector remainder(size_t k, const coefficient_vector& p) const {
+		const auto& node = nodes[k];
+		if (p.size() >= node.size()
+				&& p.size() - node.size() + 1 <= inverses[k].size()) {
+			return divide_newton(p, node, inverses[k]).second;
+		}
+		return divide_dense(p, node).second;
+	}
+
+	void evaluate(size_t k, size_t first, size_t last, const coefficient_vector& p,
+			coefficient_vector& values) const {
+		auto r = remainder(k, p);
+		if (last - first <= subproduct_leaf_size) {
+			evaluate_horner(r, montgomery_points.data() + first, values.data() + first,
+					last - first);
+			return;
+		}
+		size_t middle = first + (last - first) / 2;
+		evaluate(2 * k + 1, first, middle, r, values);
+		evaluate(2 * k + 2, middle, last, r, values);
+	}
+
+	coefficient_vector combine(size_t k, size_t first, size_t last,
+			const coefficient_vector& weights) const {
+		if (last - first <= subproduct_leaf_size) {
+			//synthetic division of the node by (x - points[i])
+			const auto& node = nodes[k];
+			coefficient_vector result(last - first, 0), quotient(last - first);
+			for (size_t i = first; i < last; ++i) {
+				quotient.back() = node.back();
+				for (size_t j = quotient.size() - 1; j-- > 0;) {
+					quotient[j] = add_mod(node[j + 1], mul_mod(quotient[j + 1], points[i]));
+				}
+				kernels().scale(quotient.data(), quotient.data(), weights[i], quotient.size());
+				kernels().add(result.data(), quotient.data(), result.size());
+			}
+			return result;
+		}
+		size_t middle = first + (last - first) / 2;
+		auto left = multiply(combine(2 * k + 1, first, middle, weights),
+				nodes[2 * k + 2], polynomial::thresholds);
+		auto right = multiply(combine(2 * k + 2, middle, last, weights),
+				nodes[2 * k + 1], polynomial::thresholds);
+		if (left.size() < right.size()) {
+			std::swap(left, right);
+		}
+		kernels().add(left.data(), right.data(), right.size());
+		return left;
+	}
+};
+
+//inverses of all values with a single exponentiation, values must be nonzero
+coefficient_vector batch_inverse(const coefficient_vector& values) {
+	coefficient_vector prefix(values.size() + 1, 1);
+	for (size_t i = 0; i < values.size(); ++i) {
+		prefix[i + 1] = mul_mod(prefix[i], values[i]);
+	}
+	uint64_t inverse = power(prefix.back(), mod - 2, mod);
+	coefficient_vector result(values.size());
+	for (size_t i = values.size(); i-- > 0;) {
+		result[i] = mul_mod(inverse, prefix[i]);
+		inverse = mul_mod(inverse, values[i]);
+	}
+	return result;
+}
+
+coefficient_vector random_coefficients(size_t n, std::mt19937& generator) {
+	std::uniform_int_distribution<polynomial::uint_type> distribution(0,
+			polynomial::MOD - 1);
+	coefficient_vector v(n);
+	for (auto& x : v) {
+		x = distribution(generator);
+	}
+	return v;
+}
+
+//average time of multiplying two random operands of size n, in seconds
+double time_multiply(size_t n, const thresholds_type& thresholds,
+		std::mt19937& generator) {
+	using clock = std::chrono::steady_clock;
+	const auto min_duration = std::chrono::milliseconds(10);
+
+	auto lhs = random_coefficients(n, generator), rhs = random_coefficients(n,
+			generator);
+	size_t repetitions = 0;
+	auto start = clock::now();
+	auto elapsed = clock::duration::zero();
+	do {
+		multiply(lhs, rhs, thresholds);
+		++repetitions;
+		elapsed = clock::now() - start;
+	} while (elapsed < min_duration);
+	return std::chrono::duration<double>(elapsed).count() / repetitions;
+}
+
+//returns the first of sizes not below lower_bound at which the algorithm selected
+//by threshold, a member of thresholds_type, is faster than the tiers below it
+size_t find_crossover(thresholds_type base, size_t thresholds_type::*threshold,
+		size_t lower_bound, const std::vector<size_t>& sizes,
+		std::mt19937& generator) {
+	for (size_t n : sizes) {
+		if (n < lower_bound) {
+			continue;
+		}
+		thresholds_type with = base, without = base;
+		with.*threshold = n;
+		without.*threshold = std::numeric_limits<size_t>::max();
+		if (time_multiply(n, with, generator)
+				< time_multiply(n, without, generator)) {
+			return n;
+		}
+	}
+	return std::numeric_limits<size_t>::max();
+}
+
+}
+
+polynomial::multiplication_thresholds polynomial::thresholds = { 64, 96, 2048 };
+
+unsigned polynomial::threads = 0;
+
+void polynomial::make_dense() {
+	if (dense) {
+		return;
+	}
+	coefficients.assign(size(), 0);
+	for (auto& term : terms) {
+		coefficients[term.first] = term.second;
+	}
+	terms.clear();
+	dense = true;
+}
+
+void polynomial::make_sparse() {
+	if (!dense) {
+		return;
+	}
+	for_each_term([this](uint_type degree, uint_type coefficient) {
+		terms.emplace_hint(terms.end(), degree, coefficient);
+	});
+	coefficients.clear();
+	coefficients.shrink_to_fit();
+	dense = false;
+}
+
+void polynomial::normalize() {
+	if (dense) {
+		while (!coefficients.empty() && coefficients.back() == 0) {
+			coefficients.pop_back();
+		}
+		auto nonzero = coefficients.size()
+				- std::count(coefficients.begin(), coefficients.end(), 0);
+		if (nonzero * sparse_ratio < coefficients.size()) {
+			make_sparse();
+		}
+	} else if (!terms.empty() && terms.size() * dense_ratio >= size()) {
+		make_dense();
+	}
+}
+
+void polynomial::combine(const polynomial& rhs, bool negate) {
+	if (&rhs == this) {
+		combine(polynomial(rhs), negate);
+		return;
+	}
+
+	auto apply = [negate](uint_type lhs, uint_type rhs) -> uint_type {
+		return negate ? sub_mod(lhs, rhs) : add_mod(lhs, rhs);
+	};
+
+	//the representation follows the expected density of the result, so a few terms
+	//added to a dense polynomial go straight into its vector
+	size_t result_size = std::max(size(), rhs.size());
+	if ((term_bound() + rhs.term_bound()) * dense_ratio >= result_size) {
+		make_dense();
+		if (coefficients.size() < rhs.size()) {
+			coefficients.resize(rhs.size(), 0);
+		}
+		if (rhs.dense) {
+			auto kernel = negate ? kernels().sub : kernels().add;
+			kernel(coefficients.data(), rhs.coefficients.data(), rhs.size());
+		} else {
+			rhs.for_each_term([&](uint_type degree, uint_type coefficient) {
+				coefficients[degree] = apply(coefficients[degree], coefficient);
+			});
+		}
+	} else {
+		make_sparse();
+		rhs.for_each_term([&](uint_type degree, uint_type coefficient) {
+			auto it = terms.emplace(degree, 0).first;
+			it->second = apply(it->second, coefficient);
+			if (it->second == 0) {
+				terms.erase(it);
+			}
+		});
+	}
+	normalize();
+}
+
+polynomial& polynomial::operator+=(const polynomial& rhs) {
+	combine(rhs, false);
 	return *this;
 }
 
-polynomial& polynomial::operator-=(const polynomial& rhs) {
-	for (auto p : rhs.data) {
-		auto it = data.emplace(p.first, 0).first;
-		it->second -= p.second;
-		it->second %= MOD;
-		if (it->second == 0) {
-			data.erase(it);
+void polynomial::negate() {
+	if (dense) {
+		kernels().scale(coefficients.data(), coefficients.data(), mod - 1,
+				coefficients.size());
+	} else {
+		for (auto& term : terms) {
+			term.second = mod - term.second;
 		}
 	}
-	validate_empty();
+}
+
+polynomial& polynomial::operator-=(const polynomial& rhs) {
+	combine(rhs, true);
 	return *this;
 }
 
@@ -38,113 +1213,270 @@ std::pair<polynomial, polynomial> polynomial::divide(const polynomial& divident,
 		throw std::domain_error("divisor is zero");
 	}
 
-	polynomial quotient = 0;
-	polynomial remainder = divident;
+	polynomial quotient, remainder = divident;
+	if (divident.size() < divisor.size()) {
+		return {quotient, remainder};
+	}
 
-	polynomial* rem_ptr = &remainder; //capture by reference does not work here
+	if (divident.dense && divisor.dense) {
+		auto result = divide_dense(divident.coefficients, divisor.coefficients);
+		quotient.dense = true;
+		quotient.coefficients = std::move(result.first);
+		remainder.coefficients = std::move(result.second);
+	} else {
+		//long division on the terms, cheap when the divisor has few of them
+		remainder.make_sparse();
+		uint_type divisor_degree = divisor.degree();
+		uint_type inverse = power(divisor.coefficient(divisor_degree), mod - 2, mod);
+		while (!remainder.terms.empty()
+				&& remainder.terms.begin()->first >= divisor_degree) {
+			uint_type degree = remainder.terms.begin()->first - divisor_degree;
+			uint_type coefficient = mul_mod(remainder.terms.begin()->second, inverse);
+			quotient.terms.emplace_hint(quotient.terms.end(), degree, coefficient);
+			divisor.for_each_term([&](uint_type d, uint_type c) {
+				auto it = remainder.terms.emplace(degree + d, 0).first;
+				it->second = sub_mod(it->second, mul_mod(coefficient, c));
+				if (it->second == 0) {
+					remainder.terms.erase(it);
+				}
+			});
+		}
+	}
+	quotient.normalize();
+	remainder.normalize();
+	return {quotient, remainder};
+}
+
+polynomial::eval_type polynomial::operator()(eval_type val) const {
+	//Horner's method, gaps between sparse terms are skipped by exponentiation
+	uint_type x = reduce(val);
+	auto shift = [x](uint_type value, uint_type gap) {
+		return gap == 1 ? mul_mod(value, x) : mul_mod(value, power(x, gap, mod));
+	};
+	uint_type result = 0;
+	uint_type prev = size();
+	for_each_term([&](uint_type degree, uint_type coefficient) {
+		result = add_mod(shift(result, prev - degree), coefficient);
+		prev = degree;
+	});
+	return balanced(shift(result, prev));
+}
 
-	//generator of the leading term of remainder
-	//doesn't skip zeros
-	std::function<polynomial()> leading = [rem_ptr] {
-		int deg = rem_ptr->degree() + 1;
-		return [=]() mutable {
-			--deg;
-			return polynomial { {deg, (*rem_ptr)[deg]}};
-		};
-	}();
+std::vector<polynomial::eval_type> polynomial::evaluate(
+		const std::vector<eval_type>& points) const {
+	std::vector<eval_type> values(points.size());
+	if (!dense) {
+		std::transform(points.begin(), points.end(), values.begin(),
+				[this](eval_type point) {return (*this)(point);});
+		return values;
+	}
+	if (std::min(points.size(), coefficients.size()) >= multipoint_threshold) {
+		return multipoint_evaluate(*this, points);
+	}
 
-	polynomial divisor_leading { { divisor.degree(), divisor[divisor.degree()] } };
+	//one Horner step over all the points at a time
+	coefficient_vector x(points.size()), result(points.size());
+	for (size_t i = 0; i < points.size(); ++i) {
+		x[i] = to_montgomery(reduce(points[i]));
+	}
+	evaluate_horner(coefficients, x.data(), result.data(), result.size());
+	std::transform(result.begin(), result.end(), values.begin(), balanced);
+	return values;
+}
 
-	polynomial term;
-	while (remainder.degree() >= divisor.degree()) {
-		polynomial ld = leading();
-		term = div_monomial(ld, divisor_leading);
-		quotient += term;
-		remainder -= term * divisor;
+std::vector<polynomial::eval_type> polynomial::multipoint_evaluate(
+		const polynomial& p, const std::vector<eval_type>& points) {
+	if (!p.dense) {
+		return p.evaluate(points);
 	}
 
-	quotient.clean_zeros();
-	remainder.clean_zeros();
+	coefficient_vector x(points.size());
+	std::transform(points.begin(), points.end(), x.begin(), reduce);
+	auto result = subproduct_tree(x).evaluate(p.coefficients);
 
-	return {quotient, remainder};
+	std::vector<eval_type> values(points.size());
+	std::transform(result.begin(), result.end(), values.begin(), balanced);
+	return values;
 }
 
-polynomial::eval_type polynomial::operator()(eval_type val) const {
-	//Horner's method
-	eval_type result = 0;
-	auto it = data.begin();
-	std::pair<uint_type, int_type> prev = *it;
-	for (std::pair<uint_type, int_type> curr; it != data.end(); ++it) {
-		curr = *it;
-		result *= std::pow(val, prev.first - curr.first);
-		result += curr.second;
-
-		prev = curr;
-	}
-	result *= std::pow(val, prev.first - 0);
-	return result;
+polynomial polynomial::interpolate(const std::vector<eval_type>& points,
+		const std::vector<eval_type>& values) {
+	if (points.size() != values.size()) {
+		throw std::invalid_argument("points and values differ in size");
+	}
+
+	coefficient_vector x(points.size());
+	std::transform(points.begin(), points.end(), x.begin(), reduce);
+	subproduct_tree tree(x);
+
+	//Lagrange's formula: p = sum of values[i] / m'(points[i]) * m / (x - points[i])
+	//where m is the product of all (x - points[i])
+	const auto& root = tree.root();
+	coefficient_vector derivative(root.empty() ? 0 : root.size() - 1);
+	for (size_t i = 0; i < derivative.size(); ++i) {
+		derivative[i] = mul_mod(root[i + 1], i + 1);
+	}
+	auto weights = tree.evaluate(derivative);
+	if (std::count(weights.begin(), weights.end(), 0) != 0) {
+		throw std::domain_error("points are not distinct");
+	}
+	weights = batch_inverse(weights);
+	for (size_t i = 0; i < weights.size(); ++i) {
+		weights[i] = mul_mod(weights[i], reduce(values[i]));
+	}
+
+	polynomial p;
+	p.dense = true;
+	p.coefficients = tree.combine(weights);
+	p.normalize();
+	return p;
 }
 
 polynomial operator*(const polynomial& lhs, const polynomial& rhs) {
 	polynomial p;
-	polynomial::eval_type tmp;
-	for (auto a : lhs.data) {
-		for (auto b : rhs.data) {
-			auto it = p.data.emplace(a.first + b.first, 0).first;
-
-			//use a 64 bit integer to prevent overflow
-			tmp = it->second;
-			tmp += static_cast<polynomial::eval_type>(a.second)
-					* static_cast<polynomial::eval_type>(b.second);
-			tmp %= polynomial::MOD;
-			it->second = tmp;
+	fma(p, lhs, rhs);
+	return p;
+}
 
+polynomial& fma(polynomial& acc, const polynomial& lhs, const polynomial& rhs) {
+	if (lhs.size() == 0 || rhs.size() == 0) {
+		return acc;
+	}
+	if (&acc == &lhs || &acc == &rhs) {
+		return acc += lhs * rhs;
+	}
+
+	//as in combine, the representation follows the expected density of the result,
+	//so acc is never densified for a product far above or below its terms
+	auto dense_result = [&acc](size_t product_terms, size_t product_size) {
+		return (acc.term_bound() + product_terms) * polynomial::dense_ratio
+				>= std::max<size_t>(acc.size(), product_size);
+	};
+	size_t product_size = lhs.size() + rhs.size() - 1;
+	if (lhs.dense && rhs.dense && !dense_result(product_size, product_size)) {
+		//only a sparse acc, as a dense one has at least as many terms as its size
+		auto product = multiply(lhs.coefficients, rhs.coefficients, polynomial::thresholds);
+		auto hint = acc.terms.end();
+		for (size_t degree = 0; degree < product.size(); ++degree) {
+			if (product[degree] == 0) {
+				continue;
+			}
+			auto it = acc.terms.emplace_hint(hint, degree, 0);
+			it->second = add_mod(it->second, product[degree]);
 			if (it->second == 0) {
-				p.data.erase(it);
+				hint = acc.terms.erase(it);
+			} else {
+				hint = it;
+			}
+		}
+	} else if (lhs.dense && rhs.dense) {
+		acc.make_dense();
+		auto& result = acc.coefficients;
+		if (use_schoolbook(std::min(lhs.size(), rhs.size()), polynomial::thresholds)) {
+			//the partial products are summed straight into acc
+			result.resize(std::max(result.size(), product_size), 0);
+			multiply_add_schoolbook(result, lhs.coefficients, rhs.coefficients);
+		} else {
+			auto product = multiply(lhs.coefficients, rhs.coefficients,
+					polynomial::thresholds);
+			if (result.size() < product.size()) {
+				std::swap(result, product);
+			}
+			kernels().add(result.data(), product.data(), product.size());
+		}
+	} else {
+		//128 bit sums of the partial products, reduced once per term
+		std::map<polynomial::uint_type, std::pair<uint64_t, uint64_t>,
+				std::greater<polynomial::uint_type>> sums;
+		lhs.for_each_term([&](polynomial::uint_type a_degree, polynomial::uint_type a) {
+			rhs.for_each_term([&](polynomial::uint_type b_degree, polynomial::uint_type b) {
+				auto& sum = sums[a_degree + b_degree];
+				uint64_t tmp = uint64_t(a) * b;
+				sum.second += tmp;
+				sum.first += sum.second < tmp;
+			});
+		});
+
+		size_t sums_size = sums.begin()->first + 1;
+		if (dense_result(sums.size(), sums_size)) {
+			acc.make_dense();
+			if (acc.size() < sums_size) {
+				acc.coefficients.resize(sums_size, 0);
+			}
+		} else {
+			acc.make_sparse();
+		}
+		for (auto& sum : sums) {
+			polynomial::uint_type coefficient = reduce(sum.second.first, sum.second.second);
+			if (acc.dense) {
+				auto& c = acc.coefficients[sum.first];
+				c = add_mod(c, coefficient);
+			} else {
+				auto it = acc.terms.emplace(sum.first, 0).first;
+				it->second = add_mod(it->second, coefficient);
+				if (it->second == 0) {
+					acc.terms.erase(it);
+				}
 			}
 		}
 	}
-	p.validate_empty();
-	return p;
+	acc.normalize();
+	return acc;
 }
 
-std::ostream& operator<<(std::ostream& os, const polynomial& p) {
-	auto it = p.data.begin();
+polynomial::multiplication_thresholds polynomial::tune_multiplication() {
+	std::mt19937 generator(0);
+	const size_t none = std::numeric_limits<size_t>::max();
 
-	//print the first one
-	if (it->second == -1 && it->first != 0) {
-		os << "-";
-	} else if (it->second != 1 || it->first == 0) {
-		os << it->second;
-	}
+	//each tier is measured with the tiers below it already in place
+	multiplication_thresholds tuned = { none, none, none };
+	tuned.karatsuba = find_crossover(tuned, &multiplication_thresholds::karatsuba, 0,
+			{ 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256 }, generator);
+	tuned.toom3 = find_crossover(tuned, &multiplication_thresholds::toom3,
+			tuned.karatsuba, { 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 }, generator);
+	tuned.ntt = find_crossover(tuned, &multiplication_thresholds::ntt,
+			std::min(tuned.karatsuba, tuned.toom3), { 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 },
+			generator);
+
+	thresholds = tuned;
+	return tuned;
+}
 
-	if (it->first > 1) {
-		os << "x^" << it->first;
-	} else if (it->first == 1) {
-		os << "x";
+std::ostream& operator<<(std::ostream& os, const polynomial& p) {
+	if (p.size() == 0) {
+		return os << 0;
 	}
-	++it;
-	//print the rest
-	for (; it != p.data.end(); ++it) {
-		if (it->second > 0) {
+
+	bool first = true;
+	p.for_each_term([&](polynomial::uint_type degree, polynomial::uint_type value) {
+		polynomial::int_type coefficient = polynomial::balanced(value);
+		if (first) {
+			//print the first one
+			if (coefficient == -1 && degree != 0) {
+				os << "-";
+			} else if (coefficient != 1 || degree == 0) {
+				os << coefficient;
+			}
+			first = false;
+		} else if (coefficient > 0) {
+			//print the rest
 			os << " + ";
-			if (it->second != 1 || it->first == 0) {
-				os << it->second;
+			if (coefficient != 1 || degree == 0) {
+				os << coefficient;
 			}
-		} else if (it->second < 0) {
+		} else {
 			os << " - ";
-			if (it->second != -1 || it->first == 0) {
-				os << -(it->second);
+			if (coefficient != -1 || degree == 0) {
+				os << -coefficient;
 			}
-		} else {
-			continue;
 		}
-		if (it->first > 1) {
-			os << "x^" << it->first;
-		} else if (it->first == 1) {
+
+		if (degree > 1) {
+			os << "x^" << degree;
+		} else if (degree == 1) {
 			os << "x";
 		}
-	}
+	});
 
 	return os;
 }
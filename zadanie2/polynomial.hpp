@@ -9,6 +9,7 @@
 #include <ostream>
 #include <initializer_list>
 #include <map>
+#include <vector>
 #include <utility>
 #include <algorithm>
 #include <cstdint>
@@ -17,6 +18,10 @@
 
 /**
  * A single indeterminate (x) polynomial. Coefficients are integers modulo 10^9 + 9.
+ * Polynomials with enough nonzero terms are stored as a contiguous vector of coefficients,
+ * sparse ones as a map of terms. The representation is picked automatically.
+ * Coefficients are kept as residues, so they are read and printed as the balanced residue
+ * in range `(-MOD / 2, MOD / 2]`: a coefficient given as 600000000 reads back as -400000009.
  */
 class polynomial {
 public:
@@ -31,45 +36,61 @@ public:
 
 	static const int_type MOD = 1e9 + 9;
 
+	/**
+	 * Sizes of the shorter operand from which multiplication of dense polynomials
+	 * switches from the schoolbook method to Karatsuba, Toom-3 and NTT.
+	 */
+	struct multiplication_thresholds {
+		size_t karatsuba;
+		size_t toom3;
+		size_t ntt;
+	};
+
+	/**
+	 * Thresholds used by multiplication. Defaults are tuned for a typical x86-64 machine,
+	 * see `tune_multiplication`.
+	 */
+	static multiplication_thresholds thresholds;
+
+	/**
+	 * Number of threads that multiply large polynomials, the calling one included.
+	 * 0, the default, means the number of hardware threads. Results do not depend on it.
+	 * Set it while no multiplication is running.
+	 */
+	static unsigned threads;
+
 	/**
 	 * Zero polynomial.
 	 */
 	polynomial() {
-		data.insert( { 0, 0 });
 	}
 
 	/**
 	 * Constant polynomial.
 	 * Allows implicit conversion from integral types.
 	 */
-	polynomial(int_type val) {
-		data.insert( { 0, val % MOD });
+	polynomial(int_type val) :
+			dense(true), coefficients(1, reduce(val)) {
+		normalize();
 	}
 
 	/**
 	 * Polynomial with all terms that have degree in range `[0, n]`. All coefficients set to 1.
 	 */
-	polynomial(uint_type n, all_one_ctor) {
-		for (int i = n; i >= 0; --i) {
-			data.emplace_hint(data.end(), i, 1);
-		}
+	polynomial(uint_type n, all_one_ctor) :
+			dense(true), coefficients(n + 1, 1) {
 	}
 
 	/**
 	 * Constructs a polynomial with its coefficients copied from range `[first, last)`.
 	 */
 	template<typename input_iterator>
-	polynomial(input_iterator first, input_iterator last) {
-		int_type tmp;
-		for (int i = std::distance(first, last) - 1; first != last;
-				--i, ++first) {
-			tmp = *first % MOD;
-			if (tmp == 0) {
-				continue;
-			}
-			data.emplace_hint(data.end(), i, tmp);
+	polynomial(input_iterator first, input_iterator last) :
+			dense(true), coefficients(std::distance(first, last)) {
+		for (auto it = coefficients.rbegin(); first != last; ++it, ++first) {
+			*it = reduce(*first);
 		}
-		validate_empty();
+		normalize();
 	}
 
 	/**
@@ -94,15 +115,15 @@ public:
 	 */
 	template<typename input_iterator>
 	polynomial(input_iterator first, input_iterator last, pair_ctor) {
-		int_type tmp;
+		uint_type tmp;
 		for (; first != last; ++first) {
-			tmp = first->second % MOD;
+			tmp = reduce(first->second);
 			if (tmp == 0) {
 				continue;
 			}
-			data.emplace_hint(data.end(), first->first, tmp);
+			terms.emplace(first->first, tmp);
 		}
-		validate_empty();
+		normalize();
 	}
 
 	/**
@@ -118,21 +139,23 @@ public:
 	 * Returns the degree of the polynomial or -1 if it's the zero polynomial.
 	 */
 	int_type degree() const {
-		auto deg = *data.begin();
-		if (deg.first == 0 && deg.second == 0) {
-			return -1;
-		} else {
-			return deg.first;
-		}
+		return static_cast<int_type>(size()) - 1;
 	}
 
 	/**
 	 * Returns the coefficient of the term that is the given degree.
 	 * (Zero if such a term does not exist.)
+	 * Coefficients are returned in range `(-MOD / 2, MOD / 2]`, whatever the sign they were given with.
 	 */
 	int_type operator[](uint_type degree) const {
-		auto it = data.find(degree);
-		return it != data.end() ? it->second : 0;
+		return balanced(coefficient(degree));
+	}
+
+	/**
+	 * Returns true if the coefficients are stored in a contiguous vector.
+	 */
+	bool is_dense() const {
+		return dense;
 	}
 
 	/**
@@ -148,6 +171,14 @@ public:
 		return lhs;
 	}
 
+	/**
+	 * Addition, reuses the storage of a temporary right operand.
+	 */
+	friend polynomial operator+(const polynomial& lhs, polynomial&& rhs) {
+		rhs += lhs;
+		return std::move(rhs);
+	}
+
 	/**
 	 * Subtraction assignment.
 	 */
@@ -158,11 +189,25 @@ public:
 		return lhs;
 	}
 
+	/**
+	 * Subtraction, reuses the storage of a temporary right operand.
+	 */
+	friend polynomial operator-(const polynomial& lhs, polynomial&& rhs) {
+		if (&lhs == &rhs) {
+			//a - std::move(a), negating rhs would negate lhs as well
+			rhs -= lhs;
+			return std::move(rhs);
+		}
+		rhs.negate();
+		rhs += lhs;
+		return std::move(rhs);
+	}
+
 	/**
 	 * Multiplication assignment.
 	 */
 	polynomial& operator*=(const polynomial& rhs) {
-		data = (*this * rhs).data;
+		*this = *this * rhs;
 		return *this;
 	}
 
@@ -172,12 +217,36 @@ public:
 	friend polynomial operator*(const polynomial& lhs, const polynomial& rhs);
 
 	/**
-	 * Evaluates the polynomial at the given value of x.
+	 * Fused multiply-add: adds `lhs * rhs` to `acc` without building the product
+	 * as a separate polynomial.
+	 * @return acc
+	 */
+	friend polynomial& fma(polynomial& acc, const polynomial& lhs,
+			const polynomial& rhs);
+
+	/**
+	 * Benchmarks the multiplication algorithms on this machine and sets `thresholds`
+	 * to the measured crossover points. Takes under a second.
+	 * @return the new thresholds
+	 */
+	static multiplication_thresholds tune_multiplication();
+
+	/**
+	 * Evaluates the polynomial at the given value of x modulo MOD.
+	 * The result is in range `(-MOD / 2, MOD / 2]`.
 	 */
 	eval_type operator()(eval_type val) const;
 
 	/**
-	 * Performs a polynomial long division.
+	 * Evaluates the polynomial at every point, see `operator()`.
+	 * Dense polynomials are evaluated at several points at a time,
+	 * large ones through `multipoint_evaluate`.
+	 */
+	std::vector<eval_type> evaluate(const std::vector<eval_type>& points) const;
+
+	/**
+	 * Performs a polynomial division modulo MOD.
+	 * Large dense operands are divided through a Newton iteration reciprocal.
 	 * @return a pair containing quotient and remainder
 	 * @throws domain_error if divisor is zero
 	 */
@@ -185,7 +254,7 @@ public:
 			const polynomial& divisor);
 
 	/**
-	 * Performs a polynomial long division and returns the quotient.
+	 * Performs a polynomial division and returns the quotient.
 	 * @throws domain_error if divisor is zero
 	 */
 	static polynomial quotient(const polynomial& divident,
@@ -194,7 +263,7 @@ public:
 	}
 
 	/**
-	 * Performs a polynomial long division and returns the remainder.
+	 * Performs a polynomial division and returns the remainder.
 	 * @throws domain_error if divisor is zero
 	 */
 	static polynomial remainder(const polynomial& divident,
@@ -202,6 +271,22 @@ public:
 		return divide(divident, divisor).second;
 	}
 
+	/**
+	 * Evaluates a polynomial at every point with a subproduct tree, in O(M(n) log n) time
+	 * for n points and degree below n. Values are in range `(-MOD / 2, MOD / 2]`.
+	 */
+	static std::vector<eval_type> multipoint_evaluate(const polynomial& p,
+			const std::vector<eval_type>& points);
+
+	/**
+	 * Returns the polynomial of the lowest degree that takes the given values at the given points,
+	 * in O(M(n) log n) time for n points.
+	 * @throws invalid_argument if there are not as many values as points
+	 * @throws domain_error if two points are equal modulo MOD
+	 */
+	static polynomial interpolate(const std::vector<eval_type>& points,
+			const std::vector<eval_type>& values);
+
 	/**
 	 * Returns a monomial that is given degree with its coefficient set to 1.
 	 */
@@ -210,36 +295,80 @@ public:
 	}
 
 	/**
-	 * Stream output.
+	 * Stream output. Coefficients are printed as returned by `operator[]`.
 	 */
 	friend std::ostream& operator<<(std::ostream& os, const polynomial& p);
 
 private:
-	std::map<uint_type, int_type, std::greater<uint_type>> data;
+	//switch to the dense representation when at least 1/dense_ratio of the terms are nonzero
+	//and back to the sparse one below 1/sparse_ratio
+	static const uint_type dense_ratio = 4;
+	static const uint_type sparse_ratio = 16;
+
+	//coefficients are kept reduced to [0, MOD)
+	//dense: coefficients[i] is the coefficient of x^i, the last one is nonzero
+	//sparse: terms holds only the nonzero terms
+	//the zero polynomial has both empty
+	bool dense = false;
+	std::vector<uint_type> coefficients;
+	std::map<uint_type, uint_type, std::greater<uint_type>> terms;
+
+	static uint_type reduce(eval_type val) {
+		val %= MOD;
+		return val < 0 ? val + MOD : val;
+	}
 
-	//data shouldn't be empty
-	void validate_empty() {
-		if (data.size() == 0) {
-			data.insert( { 0, 0 });
+	static int_type balanced(uint_type val) {
+		return val > static_cast<uint_type>(MOD / 2) ? val - MOD : val;
+	}
+
+	//degree + 1
+	uint_type size() const {
+		if (dense) {
+			return coefficients.size();
 		}
+		return terms.empty() ? 0 : terms.begin()->first + 1;
 	}
 
-	void clean_zeros() {
-		for (auto it = data.begin(); it != data.end(); ++it) {
-			if (it->second == 0) {
-				data.erase(it);
-			}
+	//at least the number of nonzero terms
+	size_t term_bound() const {
+		return dense ? coefficients.size() : terms.size();
+	}
+
+	uint_type coefficient(uint_type degree) const {
+		if (dense) {
+			return degree < coefficients.size() ? coefficients[degree] : 0;
 		}
-		validate_empty();
+		auto it = terms.find(degree);
+		return it != terms.end() ? it->second : 0;
 	}
 
-	static polynomial div_monomial(const polynomial& divident,
-			const polynomial& divisor) {
-		int_type degree = divident.degree() - divisor.degree();
-		int_type coefficient = divident.data.begin()->second
-				/ divisor.data.begin()->second;
-		return { {degree, coefficient}};
+	//calls f(degree, coefficient) for every nonzero term from the highest degree
+	template<typename function>
+	void for_each_term(function f) const {
+		if (dense) {
+			for (uint_type i = coefficients.size(); i-- > 0;) {
+				if (coefficients[i] != 0) {
+					f(i, coefficients[i]);
+				}
+			}
+		} else {
+			for (auto& term : terms) {
+				f(term.first, term.second);
+			}
+		}
 	}
+
+	void make_dense();
+	void make_sparse();
+
+	//trims the dense representation and picks the one that fits the density
+	void normalize();
+
+	void combine(const polynomial& rhs, bool negate);
+
+	//replaces every coefficient with its additive inverse
+	void negate();
 };
 
 #endif /* POLYNOMIAL_HPP_ */